@@ -238,6 +238,7 @@ static uint32_t num_corruption_errors = 0;
 static bb_badblocks_list bb_list = NULL;
 static blk64_t next_bad = 0;
 static bb_badblocks_iterate bb_iter = NULL;
+static uint64_t random_seed = 0;
 
 static __inline void *allocate_buffer(size_t size) {
 	return _mm_malloc(size, BB_SYS_PAGE_SIZE);
@@ -326,6 +327,30 @@ static void CALLBACK alarm_intr(HWND hwnd, UINT uMsg, UINT_PTR idEvent, DWORD dw
 	print_status();
 }
 
+/*
+ * Counter based pseudo random generator (SplitMix64 finalizer): every 64-bit
+ * word is derived from the seed and its absolute position on the disk only, so
+ * that each block gets unique content, which can be regenerated for comparison
+ * instead of having to be kept, and data from remapped blocks can be detected.
+ */
+static __inline uint64_t pattern_rand(uint64_t seed, uint64_t counter)
+{
+	uint64_t z = seed + counter * 0x9E3779B97F4A7C15ULL;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+static void random_fill(unsigned char *buffer, blk64_t block, size_t nb_blocks,
+			size_t block_size)
+{
+	uint64_t *ptr = (uint64_t*)buffer, counter = block * (block_size / sizeof(uint64_t));
+	size_t i, n = nb_blocks * block_size / sizeof(uint64_t);
+
+	for (i = 0; i < n; i++)
+		ptr[i] = pattern_rand(random_seed, counter + i);
+}
+
 static void pattern_fill(unsigned char *buffer, unsigned int pattern,
 			 size_t n)
 {
@@ -334,11 +359,9 @@ static void pattern_fill(unsigned char *buffer, unsigned int pattern,
 
 	if (pattern == (unsigned int) ~0) {
 		PrintInfo(3500, MSG_236);
-		srand((unsigned int)GetTickCount64());
-		for (ptr = buffer; ptr < buffer + n; ptr++) {
-			// coverity[dont_call]
-			(*ptr) = rand() % (1 << (8 * sizeof(char)));
-		}
+		/* The actual data is generated for each block by random_fill() */
+		random_seed = pattern_rand(GetTickCount64(), (uintptr_t)buffer);
+		cur_pattern++;
 	} else {
 		PrintInfo(3500, MSG_237, pattern);
 		bpattern[0] = 0;
@@ -404,17 +427,39 @@ static int64_t do_write(HANDLE hDrive, unsigned char * buffer, uint64_t tryout,
 	return got;
 }
 
+/*
+ * Read-ahead request, used to keep the device busy while we compare data
+ */
+typedef struct {
+	HANDLE hDrive;
+	unsigned char *buffer;
+	uint64_t tryout;
+	uint64_t block_size;
+	blk64_t block;
+	int64_t got;
+} read_ahead_request;
+
+static DWORD WINAPI read_ahead_thread(LPVOID param)
+{
+	read_ahead_request *ra = (read_ahead_request*)param;
+
+	ra->got = do_read(ra->hDrive, ra->buffer, ra->tryout, ra->block_size, ra->block);
+	return 0;
+}
+
 static unsigned int test_rw(HANDLE hDrive, blk64_t last_block, size_t block_size, blk64_t first_block,
 							size_t blocks_at_once, int pattern_type, int nb_passes)
 {
 	const unsigned int pattern[BADLOCKS_PATTERN_TYPES][BADBLOCK_PATTERN_COUNT] =
 		{ BADBLOCK_PATTERN_ONE_PASS, BADBLOCK_PATTERN_TWO_PASSES, BADBLOCK_PATTERN_SLC,
 		  BADCLOCK_PATTERN_MLC, BADBLOCK_PATTERN_TLC };
-	unsigned char *buffer = NULL, *read_buffer;
-	int i, pat_idx;
+	unsigned char *buffer = NULL, *read_buffer, *read_buffers[2];
+	int i, pat_idx, is_random;
 	unsigned int bb_count = 0;
 	blk64_t got, tryout, recover_block = ~0, *blk_id;
 	size_t id_offset = 0;
+	HANDLE hReadAhead = INVALID_HANDLE_VALUE;
+	read_ahead_request ra = { hDrive, NULL, 0, block_size, 0, 0 };
 
 	if ((pattern_type < 0) || (pattern_type >= BADLOCKS_PATTERN_TYPES)) {
 		uprintf("%sInvalid pattern type\n", bb_prefix);
@@ -432,13 +477,15 @@ static unsigned int test_rw(HANDLE hDrive, blk64_t last_block, size_t block_size
 		return 0;
 	}
 
-	buffer = allocate_buffer(2 * blocks_at_once * block_size);
+	buffer = allocate_buffer(3 * blocks_at_once * block_size);
 	if (!buffer) {
 		uprintf("%sError while allocating buffers\n", bb_prefix);
 		cancel_ops = -1;
 		return 0;
 	}
-	read_buffer = buffer + blocks_at_once * block_size;
+	read_buffers[0] = buffer + blocks_at_once * block_size;
+	read_buffers[1] = buffer + 2 * blocks_at_once * block_size;
+	read_buffer = read_buffers[0];
 
 	uprintf("%sChecking from block %lu to %lu (1 block = %s)\n", bb_prefix,
 		(unsigned long) first_block, (unsigned long) last_block - 1,
@@ -454,7 +501,7 @@ static unsigned int test_rw(HANDLE hDrive, blk64_t last_block, size_t block_size
 			id_offset = rand() * (block_size - sizeof(blk64_t)) / RAND_MAX;
 			uprintf("%sUsing offset %zu for fake device check\n", bb_prefix, id_offset);
 		}
-		// coverity[dont_call]
+		is_random = (pattern[pattern_type][pat_idx] == (unsigned int) ~0);
 		pattern_fill(buffer, pattern[pattern_type][pat_idx], blocks_at_once * block_size);
 		num_blocks = last_block - 1;
 		currently_testing = first_block;
@@ -476,6 +523,8 @@ static unsigned int test_rw(HANDLE hDrive, blk64_t last_block, size_t block_size
 			}
 			if (currently_testing + tryout > last_block)
 				tryout = last_block - currently_testing;
+			if (is_random)
+				random_fill(buffer, currently_testing, (size_t)tryout, block_size);
 			if (detect_fakes && (pat_idx == 0)) {
 				/* Add the block number at a fixed (random) offset during each pass to
 				   allow for the detection of 'fake' media (eg. 2GB USB masquerading as 16GB) */
@@ -524,14 +573,30 @@ static unsigned int test_rw(HANDLE hDrive, blk64_t last_block, size_t block_size
 			}
 			if (currently_testing + tryout > last_block)
 				tryout = last_block - currently_testing;
+			/* Regenerate the expected data rather than keeping a copy of what was written */
+			if (is_random)
+				random_fill(buffer, currently_testing, (size_t)tryout, block_size);
 			if (detect_fakes && (pat_idx == 0)) {
 				for (i=0; i<(int)blocks_at_once; i++) {
 					blk_id = (blk64_t*)(intptr_t)(buffer + id_offset+ i*block_size);
 					*blk_id = (blk64_t)(currently_testing + i);
 				}
 			}
-			got = do_read(hDrive, read_buffer, tryout, block_size,
-				       currently_testing);
+			if (hReadAhead != INVALID_HANDLE_VALUE) {
+				/* Collect the read that was issued while we were comparing */
+				WaitForSingleObject(hReadAhead, INFINITE);
+				safe_closehandle(hReadAhead);
+				if ((ra.block == currently_testing) && (ra.tryout == tryout)) {
+					read_buffer = ra.buffer;
+					got = ra.got;
+				} else {
+					got = do_read(hDrive, read_buffer, tryout, block_size,
+						       currently_testing);
+				}
+			} else {
+				got = do_read(hDrive, read_buffer, tryout, block_size,
+					       currently_testing);
+			}
 			if (got == 0 && tryout == 1)
 				bb_count += bb_output(currently_testing++, READ_ERROR);
 			currently_testing += got;
@@ -545,6 +610,16 @@ static unsigned int test_rw(HANDLE hDrive, blk64_t last_block, size_t block_size
 				tryout = blocks_at_once;
 				recover_block = ~0;
 			}
+			/* Outside of error recovery, read the next blocks into the other buffer
+			   while we compare, so that the device doesn't sit idle in the meantime */
+			if ((tryout == blocks_at_once) && (currently_testing < last_block)) {
+				ra.buffer = (read_buffer == read_buffers[0]) ? read_buffers[1] : read_buffers[0];
+				ra.block = currently_testing;
+				ra.tryout = min(tryout, last_block - currently_testing);
+				hReadAhead = CreateThread(NULL, 0, read_ahead_thread, &ra, 0, NULL);
+				if (hReadAhead == NULL)
+					hReadAhead = INVALID_HANDLE_VALUE;
+			}
 			for (i=0; i < got; i++) {
 				if (memcmp(read_buffer + i * block_size,
 					   buffer + i * block_size,
@@ -562,6 +637,10 @@ static unsigned int test_rw(HANDLE hDrive, blk64_t last_block, size_t block_size
 		num_blocks = 0;
 	}
 out:
+	if (hReadAhead != INVALID_HANDLE_VALUE) {
+		WaitForSingleObject(hReadAhead, INFINITE);
+		safe_closehandle(hReadAhead);
+	}
 	free_buffer(buffer);
 	return bb_count;
 }
@@ -604,3 +683,262 @@ BOOL BadBlocks(HANDLE hPhysicalDrive, ULONGLONG disk_size, int nb_passes,
 		return FALSE;
 	return TRUE;
 }
+
+/*
+ * Fast fake capacity probe
+ *
+ * Rather than writing the whole drive, only a sample of sectors is written: the
+ * ones located at (and right before) every power of two, the last sector, as
+ * well as a set of random ones. The content of each sector is derived from a
+ * random seed and the sector number, so that it can be validated on readback,
+ * and also so that we can tell which sector the data we read actually belongs
+ * to, for drives that wrap around.
+ * Sectors are written from the highest to the lowest, so that, on wraparound,
+ * the data of the lowest sector (which is the one that physically exists) is
+ * the data that remains.
+ */
+#define CAP_PROBE_MAGIC                   0x424F525050414352ULL	/* "RCAPPROB" */
+#define CAP_PROBE_RANDOM                  64
+#define CAP_PROBE_REFINE                  48
+#define CAP_PROBE_MAX                     (2 * 64 + 1 + CAP_PROBE_RANDOM + CAP_PROBE_REFINE)
+/* Minimum number of failing probes, in distinct blocks, at the top of a fake drive */
+#define CAP_PROBE_MIN_FAKE                4
+
+enum probe_status { PROBE_GOOD, PROBE_BAD, PROBE_ALIASED };
+
+static void probe_fill(unsigned char *buffer, uint64_t seed, uint64_t sector, size_t sector_size)
+{
+	uint64_t *ptr = (uint64_t*)buffer, counter = sector * (sector_size / sizeof(uint64_t));
+	size_t i;
+
+	for (i = 0; i < sector_size / sizeof(uint64_t); i++)
+		ptr[i] = pattern_rand(seed, counter + i);
+	ptr[0] = CAP_PROBE_MAGIC;
+	ptr[1] = seed;
+	ptr[2] = sector;
+}
+
+/*
+ * Read back a probe sector, and return its status. If the data belongs to
+ * another probe sector, that sector is returned in alias.
+ */
+static enum probe_status probe_check(HANDLE hDrive, unsigned char *buffer, unsigned char *ref,
+				     uint64_t seed, uint64_t sector, size_t sector_size, uint64_t *alias)
+{
+	uint64_t *ptr = (uint64_t*)buffer;
+
+	if (read_sectors(hDrive, sector_size, sector, 1, buffer) != (int64_t)sector_size)
+		return PROBE_BAD;
+	if ((ptr[0] != CAP_PROBE_MAGIC) || (ptr[1] != seed))
+		return PROBE_BAD;
+	probe_fill(ref, seed, ptr[2], sector_size);
+	if (memcmp(buffer, ref, sector_size) != 0)
+		return PROBE_BAD;
+	if (ptr[2] == sector)
+		return PROBE_GOOD;
+	*alias = ptr[2];
+	return PROBE_ALIASED;
+}
+
+static int cmp_sector_desc(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return (x < y) ? 1 : ((x > y) ? -1 : 0);
+}
+
+static uint64_t gcd64(uint64_t a, uint64_t b)
+{
+	uint64_t t;
+
+	while (b != 0) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+BOOL ProbeCapacity(HANDLE hPhysicalDrive, ULONGLONG disk_size, DWORD sector_size, BOOL restore,
+		   capacity_report *report)
+{
+	BOOL r = FALSE;
+	unsigned char *buffer = NULL, *ref, *saved = NULL;
+	uint64_t sector[CAP_PROBE_MAX], nb_sectors, seed, s, alias, lowest_bad, good_below, modulus = 0, lo, hi, last_failed;
+	uint32_t i, j, nb_probes = 0, nb_saved = 0, nb_failed;
+	uint8_t status[CAP_PROBE_MAX];
+	BOOL is_fake;
+	uint64_t start_time = GetTickCount64();
+
+	if ((report == NULL) || (sector_size < 512) || (sector_size % sizeof(uint64_t) != 0))
+		return FALSE;
+	memset(report, 0, sizeof(capacity_report));
+	nb_sectors = disk_size / sector_size;
+	if (nb_sectors < 2)
+		return FALSE;
+
+	buffer = allocate_buffer((2 + (restore ? CAP_PROBE_MAX : 0)) * (size_t)sector_size);
+	if (buffer == NULL) {
+		uprintf("%sCould not allocate capacity probe buffers", bb_prefix);
+		return FALSE;
+	}
+	ref = buffer + sector_size;
+	if (restore)
+		saved = buffer + 2 * (size_t)sector_size;
+	seed = pattern_rand(GetTickCount64(), (uintptr_t)buffer);
+
+	/* Build the list of sectors to probe, and sort it from highest to lowest */
+	for (s = 1; s < nb_sectors; s <<= 1) {
+		sector[nb_probes++] = s - 1;
+		sector[nb_probes++] = s;
+	}
+	sector[nb_probes++] = nb_sectors - 1;
+	for (i = 0; i < CAP_PROBE_RANDOM; i++)
+		sector[nb_probes++] = pattern_rand(seed, i) % nb_sectors;
+	qsort(sector, nb_probes, sizeof(sector[0]), cmp_sector_desc);
+	for (i = 1, j = 0; i < nb_probes; i++) {
+		if (sector[i] != sector[j])
+			sector[++j] = sector[i];
+	}
+	nb_probes = j + 1;
+
+	uprintf("%sProbing %d sectors for fake capacity...", bb_prefix, nb_probes);
+	if (restore) {
+		for (i = 0; i < nb_probes; i++, nb_saved++) {
+			CHECK_FOR_USER_CANCEL;
+			if (read_sectors(hPhysicalDrive, sector_size, sector[i], 1, &saved[i * sector_size]) != (int64_t)sector_size) {
+				uprintf("%sCould not save sector %" PRIu64 ", aborting capacity probe", bb_prefix, sector[i]);
+				goto out;
+			}
+		}
+	}
+	for (i = 0; i < nb_probes; i++) {
+		CHECK_FOR_USER_CANCEL;
+		probe_fill(buffer, seed, sector[i], sector_size);
+		/* Write failures are reported when reading back */
+		write_sectors(hPhysicalDrive, sector_size, sector[i], 1, buffer);
+	}
+	FlushFileBuffers(hPhysicalDrive);
+
+	/* Read everything back, and look for the lowest sector that didn't retain its data */
+	lowest_bad = nb_sectors;
+	for (i = 0; i < nb_probes; i++) {
+		CHECK_FOR_USER_CANCEL;
+		status[i] = (uint8_t)probe_check(hPhysicalDrive, buffer, ref, seed, sector[i], sector_size, &alias);
+		switch (status[i]) {
+		case PROBE_GOOD:
+			continue;
+		case PROBE_ALIASED:
+			/*
+			 * On wraparound, a sector can only hold the data of a lower one, since
+			 * these were written last. Anything else is from a failed write.
+			 */
+			if (alias < sector[i]) {
+				report->nb_aliased++;
+				modulus = gcd64(modulus, sector[i] - alias);
+			} else {
+				status[i] = PROBE_BAD;
+				report->nb_bad++;
+			}
+			break;
+		default:
+			report->nb_bad++;
+			break;
+		}
+		lowest_bad = min(lowest_bad, sector[i]);
+	}
+	/*
+	 * A real drive can have a few bad sectors, so, unless the data wraps around,
+	 * only consider that the capacity is fake if none of the sectors we probed,
+	 * from the lowest failing one to the end of the disk, retained its data, and
+	 * if these failures are spread over enough blocks not to just be a few bad
+	 * sectors at the end of the disk.
+	 */
+	is_fake = (modulus != 0);
+	if (!is_fake && (lowest_bad < nb_sectors)) {
+		is_fake = TRUE;
+		nb_failed = 0;
+		last_failed = 0;
+		for (i = 0; (i < nb_probes) && (sector[i] >= lowest_bad); i++) {
+			if (status[i] == PROBE_GOOD) {
+				is_fake = FALSE;
+				break;
+			}
+			if ((nb_failed == 0) || (last_failed - sector[i] >= BADBLOCK_BLOCK_SIZE / sector_size)) {
+				nb_failed++;
+				last_failed = sector[i];
+			}
+		}
+		if (nb_failed < CAP_PROBE_MIN_FAKE)
+			is_fake = FALSE;
+	}
+
+	if (is_fake && (lowest_bad == 0)) {
+		uprintf("%sCould not write the capacity probe data", bb_prefix);
+		goto out;
+	}
+	good_below = 0;
+	for (i = 0; i < nb_probes; i++) {
+		if (sector[i] < lowest_bad) {
+			good_below = sector[i];
+			break;
+		}
+	}
+
+	if (!is_fake) {
+		report->real_size = disk_size;
+	} else if (modulus != 0) {
+		/* The data wraps around, so the actual size is the modulus */
+		report->wrap_size = modulus * sector_size;
+		report->real_size = min(modulus, lowest_bad) * sector_size;
+	} else {
+		/* Writes are discarded past the actual size => narrow it down */
+		lo = good_below;
+		hi = lowest_bad;
+		while ((hi - lo > 1) && (nb_probes < CAP_PROBE_MAX)) {
+			CHECK_FOR_USER_CANCEL;
+			s = lo + (hi - lo) / 2;
+			if (restore) {
+				if (read_sectors(hPhysicalDrive, sector_size, s, 1, &saved[nb_saved * sector_size]) != (int64_t)sector_size)
+					break;
+				nb_saved++;
+			}
+			sector[nb_probes++] = s;
+			probe_fill(buffer, seed, s, sector_size);
+			write_sectors(hPhysicalDrive, sector_size, s, 1, buffer);
+			FlushFileBuffers(hPhysicalDrive);
+			if (probe_check(hPhysicalDrive, buffer, ref, seed, s, sector_size, &alias) == PROBE_GOOD)
+				lo = s;
+			else
+				hi = s;
+		}
+		report->real_size = hi * sector_size;
+	}
+	report->nb_probes = nb_probes;
+	r = TRUE;
+
+	if (report->real_size < disk_size) {
+		/* SizeToHumanReadable() uses a static buffer, so it can only be called once per uprintf() */
+		uprintf("%sFake drive detected: only the first %s retain data", bb_prefix,
+			SizeToHumanReadable(report->real_size, FALSE, FALSE));
+		uprintf("%sReported drive size: %s", bb_prefix, SizeToHumanReadable(disk_size, FALSE, FALSE));
+		if (report->wrap_size != 0)
+			uprintf("%sData wraps around every %s (%d aliased sectors)", bb_prefix,
+				SizeToHumanReadable(report->wrap_size, FALSE, FALSE), report->nb_aliased);
+	} else {
+		uprintf("%sNo fake capacity detected", bb_prefix);
+		if (report->nb_bad != 0)
+			uprintf("%s%d probed sector(s) did not retain data, which indicates bad blocks", bb_prefix, report->nb_bad);
+	}
+
+out:
+	/* Restore the original data */
+	while (nb_saved > 0) {
+		nb_saved--;
+		write_sectors(hPhysicalDrive, sector_size, sector[nb_saved], 1, &saved[nb_saved * sector_size]);
+	}
+	if (restore)
+		FlushFileBuffers(hPhysicalDrive);
+	free_buffer(buffer);
+	uprintf("%sCapacity probe completed in %" PRIu64 " ms", bb_prefix, GetTickCount64() - start_time);
+	return r;
+}
@@ -50,8 +50,21 @@ typedef struct {
 	uint32_t num_corruption_errors;
 } badblocks_report;
 
+/*
+ * Capacity probe report
+ */
+typedef struct {
+	uint64_t real_size;			/* Size up to which written data is retained */
+	uint64_t wrap_size;			/* Size at which data wraps around, or 0 */
+	uint32_t nb_probes;
+	uint32_t nb_bad;			/* Sectors that didn't read back their own data */
+	uint32_t nb_aliased;		/* Sectors that read back the data of another sector */
+} capacity_report;
+
 /*
  * Shared prototypes
  */
 BOOL BadBlocks(HANDLE hPhysicalDrive, ULONGLONG disk_size, int nb_passes,
 	int flash_type, badblocks_report *report, FILE* fd);
+BOOL ProbeCapacity(HANDLE hPhysicalDrive, ULONGLONG disk_size, DWORD sector_size,
+	BOOL restore, capacity_report *report);
@@ -114,8 +114,20 @@ typedef struct cregex_program_instr {
     };
 } cregex_program_instr_t;
 
+/* Maximum length of the literal prefix and maximum number of required
+ * characters used to prefilter the input before running the VM
+ */
+#define REGEX_PROGRAM_MAX_PREFIX 16
+#define REGEX_PROGRAM_MAX_REQUIRED 4
+
 typedef struct {
     int ninstructions;
+    /* Number of save slots used by the program */
+    int nsaves;
+    /* Literal string that any match must start with (unanchored only) */
+    char prefix[REGEX_PROGRAM_MAX_PREFIX + 1];
+    /* Characters that must be present in the input for a match */
+    char required[REGEX_PROGRAM_MAX_REQUIRED + 1];
     cregex_program_instr_t instructions[];
 } cregex_program_t;
 
@@ -1,5 +1,6 @@
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cregex.h"
 
@@ -88,6 +89,87 @@ static bool node_is_anchored(const cregex_node_t *node)
     return false;
 }
 
+/* Append the literal characters that a match of node must start with to
+ * prefix, and return true if the whole of node was literal (in which case
+ * whatever follows node can be appended too).
+ */
+static bool literal_prefix(const cregex_node_t *node, char *prefix)
+{
+    size_t len = strlen(prefix);
+
+    switch (node->type) {
+    case REGEX_NODE_TYPE_EPSILON:
+        return true;
+
+    case REGEX_NODE_TYPE_CHARACTER:
+        if (len >= REGEX_PROGRAM_MAX_PREFIX || node->ch == '\0')
+            return false;
+        prefix[len] = (char)node->ch;
+        prefix[len + 1] = '\0';
+        return true;
+
+    case REGEX_NODE_TYPE_CONCATENATION:
+        return literal_prefix(node->left, prefix) &&
+               literal_prefix(node->right, prefix);
+
+    case REGEX_NODE_TYPE_CAPTURE:
+        return literal_prefix(node->captured, prefix);
+
+    default:
+        return false;
+    }
+}
+
+/* Append the characters that must appear in any match of node to required.
+ * Only characters that are required on every alternative are retained.
+ */
+static void required_chars(const cregex_node_t *node, char *required)
+{
+    char left[REGEX_PROGRAM_MAX_REQUIRED + 1] = "";
+    char right[REGEX_PROGRAM_MAX_REQUIRED + 1] = "";
+    size_t len = strlen(required);
+
+    switch (node->type) {
+    case REGEX_NODE_TYPE_CHARACTER:
+        if (len < REGEX_PROGRAM_MAX_REQUIRED && node->ch != '\0' &&
+            !strchr(required, node->ch)) {
+            required[len] = (char)node->ch;
+            required[len + 1] = '\0';
+        }
+        break;
+
+    case REGEX_NODE_TYPE_CONCATENATION:
+        required_chars(node->left, required);
+        required_chars(node->right, required);
+        break;
+
+    case REGEX_NODE_TYPE_ALTERNATION:
+        required_chars(node->left, left);
+        required_chars(node->right, right);
+        for (const char *ch = left; *ch; ++ch) {
+            len = strlen(required);
+            if (len < REGEX_PROGRAM_MAX_REQUIRED && strchr(right, *ch) &&
+                !strchr(required, *ch)) {
+                required[len] = *ch;
+                required[len + 1] = '\0';
+            }
+        }
+        break;
+
+    case REGEX_NODE_TYPE_QUANTIFIER:
+        if (node->nmin > 0)
+            required_chars(node->quantified, required);
+        break;
+
+    case REGEX_NODE_TYPE_CAPTURE:
+        required_chars(node->captured, required);
+        break;
+
+    default:
+        break;
+    }
+}
+
 static inline cregex_program_instr_t *emit(
     regex_compile_context *context,
     const cregex_program_instr_t *instruction)
@@ -247,34 +329,31 @@ static cregex_program_instr_t *compile_context(regex_compile_context *context,
 /* Compile a parsed pattern (using a previously allocated program with at least
  * estimate_instructions(root) instructions).
  */
-#if defined __GNUC__
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wdangling-pointer"
-#endif
 static cregex_program_t *compile_node_with_program(const cregex_node_t *root,
                                                    cregex_program_t *program)
 {
-    /* Silence a MinGW warning about dangling pointers */
-    static cregex_node_t* _root;
+    /* The nodes added around root must outlive the compilation below, so
+     * they are declared at function scope rather than as block-scoped
+     * compound literals (which the optimizer is free to reuse).
+     */
+    cregex_node_t any = {.type = REGEX_NODE_TYPE_ANY_CHARACTER};
+    cregex_node_t lazy = {.type = REGEX_NODE_TYPE_QUANTIFIER,
+                          .nmin = 0,
+                          .nmax = -1,
+                          .greedy = 0,
+                          .quantified = &any};
+    cregex_node_t capture = {.type = REGEX_NODE_TYPE_CAPTURE,
+                             .captured = (cregex_node_t *) root};
+    cregex_node_t concat = {.type = REGEX_NODE_TYPE_CONCATENATION,
+                            .left = &lazy,
+                            .right = &capture};
+
     /* add capture node for entire match */
-    root = &(cregex_node_t){.type = REGEX_NODE_TYPE_CAPTURE,
-                            .captured = (cregex_node_t *) root};
+    root = &capture;
 
     /* add .*? unless pattern starts with ^ */
-    if (!node_is_anchored(root)) {
-        _root = &(cregex_node_t){
-            .type = REGEX_NODE_TYPE_CONCATENATION,
-            .left =
-                &(cregex_node_t){
-                    .type = REGEX_NODE_TYPE_QUANTIFIER,
-                    .nmin = 0,
-                    .nmax = -1,
-                    .greedy = 0,
-                    .quantified = &(
-                        cregex_node_t){.type = REGEX_NODE_TYPE_ANY_CHARACTER}},
-            .right = (cregex_node_t *) root};
-        root = _root;
-     }
+    if (!node_is_anchored(root))
+        root = &concat;
 
     /* compile */
     regex_compile_context *context =
@@ -285,14 +364,12 @@ static cregex_program_t *compile_node_with_program(const cregex_node_t *root,
     emit(context,
          &(cregex_program_instr_t){.opcode = REGEX_PROGRAM_OPCODE_MATCH});
 
-    /* set total number of instructions */
+    /* set total number of instructions and save slots */
     program->ninstructions = (int)(context->pc - program->instructions);
+    program->nsaves = context->ncaptures * 2;
 
     return program;
 }
-#if defined __GNUC__
-#pragma GCC diagnostic pop
-#endif
 
 /* Upper bound of number of instructions required to compile parsed pattern. */
 static int estimate_instructions(const cregex_node_t *root)
@@ -319,6 +396,13 @@ cregex_program_t *cregex_compile_node(const cregex_node_t *root)
         return NULL;
     }
 
+    /* compute the data used to prefilter the input */
+    program->prefix[0] = '\0';
+    if (!node_is_anchored(root))
+        literal_prefix(root, program->prefix);
+    program->required[0] = '\0';
+    required_chars(root, program->required);
+
     return program;
 }
 
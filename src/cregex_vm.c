@@ -14,17 +14,19 @@ typedef struct {
     const char *matches[REGEX_VM_MAX_MATCHES];
 } vm_thread;
 
-/* Run program on string */
+/* Run program on string, from start */
 static int vm_run(const cregex_program_t *program,
                   const char *string,
+                  const char *start,
                   const char **matches,
                   int nmatches);
 
-/* Run program on string (using a previously allocated buffer of at least
- * vm_estimate_threads(program) threads)
+/* Run program on string, from start (using a previously allocated buffer of
+ * at least vm_estimate_threads(program) threads)
  */
 static int vm_run_with_threads(const cregex_program_t *program,
                                const char *string,
+                               const char *start,
                                const char **matches,
                                int nmatches,
                                vm_thread *threads);
@@ -104,6 +106,7 @@ static int vm_estimate_threads(const cregex_program_t *program)
 
 static int vm_run(const cregex_program_t *program,
                   const char *string,
+                  const char *start,
                   const char **matches,
                   int nmatches)
 {
@@ -114,13 +117,15 @@ static int vm_run(const cregex_program_t *program,
     if (!(threads = malloc(size)))
         return -1;
 
-    matched = vm_run_with_threads(program, string, matches, nmatches, threads);
+    matched =
+        vm_run_with_threads(program, string, start, matches, nmatches, threads);
     free(threads);
     return matched;
 }
 
 static int vm_run_with_threads(const cregex_program_t *program,
                                const char *string,
+                               const char *start,
                                const char **matches,
                                int nmatches,
                                vm_thread *threads)
@@ -134,10 +139,10 @@ static int vm_run_with_threads(const cregex_program_t *program,
     memset(matches, 0, sizeof(char*) * nmatches);
     memset(threads, 0, sizeof(vm_thread) * program->ninstructions * 2);
 
-    vm_add_thread(current, program, program->instructions, string, string,
+    vm_add_thread(current, program, program->instructions, string, start,
                   matches, nmatches);
 
-    for (const char *sp = string;; ++sp) {
+    for (const char *sp = start;; ++sp) {
         for (int i = 0; i < current->nthreads; ++i) {
             vm_thread *thread = current->threads + i;
             switch (thread->pc->opcode) {
@@ -207,5 +212,26 @@ int cregex_program_run(const cregex_program_t *program,
                        const char **matches,
                        int nmatches)
 {
-    return vm_run(program, string, matches, nmatches);
+    const char *start = string;
+
+    memset(matches, 0, sizeof(char*) * nmatches);
+
+    /* Quickly reject input that doesn't contain all the required characters
+     * or the literal prefix, and skip what precedes the prefix, since no
+     * match can start there.
+     */
+    for (const char *ch = program->required; *ch; ++ch) {
+        if (!strchr(string, *ch))
+            return 0;
+    }
+    if (program->prefix[0] &&
+        !(start = program->prefix[1] ? strstr(string, program->prefix)
+                                     : strchr(string, program->prefix[0])))
+        return 0;
+
+    /* Only copy the save slots that the program actually uses */
+    if (nmatches > program->nsaves)
+        nmatches = program->nsaves;
+
+    return vm_run(program, string, start, matches, nmatches);
 }
@@ -61,6 +61,21 @@
 /* Numbers of buffer used for asynchronous DD reads */
 #define NUM_BUFFERS 2
 
+/* Phases of the format operation we report timings for, when USB debug is enabled */
+enum format_phase {
+	PHASE_PARTITION = 0,
+	PHASE_BADBLOCKS,
+	PHASE_WRITE_DRIVE,
+	PHASE_WAIT_VOLUME,
+	PHASE_FORMAT,
+	PHASE_BOOT_RECORDS,
+	PHASE_FILE_COPY,
+	PHASE_CUSTOMIZE,
+	PHASE_FINALIZE,
+	PHASE_CLOSE,
+	PHASE_MAX
+};
+
 /*
  * Globals
  */
@@ -69,14 +84,22 @@ DWORD ErrorStatus = 0, LastWriteError = 0;
 badblocks_report report = { 0 };
 static float format_percent = 0.0f;
 static int task_number = 0, actual_fs_type;
-static unsigned int sec_buf_pos = 0;
+static const char* phase_name[PHASE_MAX] = { "Partitioning", "Bad blocks check", "Drive write",
+	"Volume wait", "Formatting", "Boot records", "File copy", "Windows customization", "Finalization",
+	"Drive close" };
+static struct {
+	uint64_t start, cpu_start;
+	uint64_t wall, cpu;
+	uint32_t count;
+} phase_time[PHASE_MAX];
 extern const int nb_steps[FS_MAX];
 extern const char* md5sum_name[2];
 extern uint32_t dur_mins, dur_secs;
 extern BOOL force_large_fat32, enable_ntfs_compression, lock_drive, zero_drive, fast_zeroing, enable_file_indexing;
 extern BOOL write_as_image, use_vds, write_as_esp, is_vds_available, has_ffu_support, use_rufus_mbr, append_silent;
 extern char* archive_path;
-uint8_t *grub2_buf = NULL, *sec_buf = NULL;
+extern RUFUS_DRIVE rufus_drive[MAX_DRIVES];
+uint8_t *grub2_buf = NULL;
 long grub2_len;
 
 /*
@@ -1086,15 +1109,58 @@ static void update_progress(const int64_t processed_bytes)
 	}
 }
 
+/*
+ * The size of the individual writes that yields the best throughput varies a lot from one
+ * device to the next. So, on the first blocks of a DD write, we try each of the candidate
+ * sizes below in turn, on data that needs to be written anyway, and then use the fastest
+ * one for the rest of the operation. The first block is only used to warm up the device,
+ * and the candidates are then measured in interleaved rounds, so that a transient slowdown
+ * does not penalize a single size. The result is cached for the last device we tuned, but
+ * only if it stood out from the measurement noise.
+ */
+#define WRITE_TUNING_ROUNDS         3
+static const DWORD write_chunk_size[] = { 1 * MB, 2 * MB, 4 * MB, 8 * MB, 16 * MB, 32 * MB };
+#define WRITE_TUNING_SIZES          ARRAYSIZE(write_chunk_size)
+// The size we use if tuning is inconclusive, which writes a whole DD buffer at once
+#define WRITE_TUNING_DEFAULT        (WRITE_TUNING_SIZES - 1)
+
+/*
+ * Per target context for the DD write operations, so that these only
+ * rely on the target they are passed, rather than on the global state.
+ */
+typedef struct {
+	HANDLE hDrive;
+	uint64_t disk_size;
+	DWORD sector_size;
+	const char* device_id;
+	// Partial sector data, for sector_write()
+	uint8_t* sec_buf;
+	unsigned int sec_buf_pos;
+	// Write size tuning (see WriteTunedBlock() below)
+	struct {
+		DWORD chunk_size;	// Size of the writes to use once tuned, 0 while we are tuning
+		int sample;		// Index of the block being measured, 0 being the warm-up one
+		LARGE_INTEGER freq;
+		uint64_t duration[WRITE_TUNING_SIZES][WRITE_TUNING_ROUNDS];
+	} tuning;
+} write_job_t;
+static write_job_t* bled_write_job = NULL;
+
 // Some compressed images use streams that aren't multiple of the sector
 // size and cause write failures => Use a write override that alleviates
 // the problem. See GitHub issue #1422 for details.
+// Since bled doesn't pass any context to its callbacks, the job this applies
+// to is the one that was set in bled_write_job.
 static int sector_write(int fd, const void* _buf, unsigned int count)
 {
 	const uint8_t* buf = (const uint8_t*)_buf;
-	unsigned int sec_size = (unsigned int)SelectedDrive.SectorSize;
+	write_job_t* job = bled_write_job;
+	unsigned int sec_size;
 	int written, fill_size = 0;
 
+	if_assert_fails(job != NULL)
+		return -1;
+	sec_size = (unsigned int)job->sector_size;
 	if (sec_size == 0)
 		sec_size = 512;
 	if_assert_fails(sec_size <= 64 * KB)
@@ -1104,21 +1170,21 @@ static int sector_write(int fd, const void* _buf, unsigned int count)
 
 	// If we are on a sector boundary and count is multiple of the
 	// sector size, just issue a regular write
-	if ((sec_buf_pos == 0) && (count % sec_size == 0))
+	if ((job->sec_buf_pos == 0) && (count % sec_size == 0))
 		return _write(fd, buf, count);
 
 	// If we have an existing partial sector, fill and write it
-	if (sec_buf_pos > 0) {
-		if_assert_fails(sec_size >= sec_buf_pos)
+	if (job->sec_buf_pos > 0) {
+		if_assert_fails(sec_size >= job->sec_buf_pos)
 			return -1;
-		fill_size = min(sec_size - sec_buf_pos, count);
-		memcpy(&sec_buf[sec_buf_pos], buf, fill_size);
-		sec_buf_pos += fill_size;
+		fill_size = min(sec_size - job->sec_buf_pos, count);
+		memcpy(&job->sec_buf[job->sec_buf_pos], buf, fill_size);
+		job->sec_buf_pos += fill_size;
 		// If we don't have a full sector just buffer it for next call
-		if (sec_buf_pos < sec_size)
+		if (job->sec_buf_pos < sec_size)
 			return (int)count;
-		sec_buf_pos = 0;
-		written = _write(fd, sec_buf, sec_size);
+		job->sec_buf_pos = 0;
+		written = _write(fd, job->sec_buf, sec_size);
 		if (written != sec_size)
 			return written;
 	}
@@ -1137,16 +1203,162 @@ static int sector_write(int fd, const void* _buf, unsigned int count)
 		else
 			return v;
 	}
-	sec_buf_pos = count - fill_size - written;
-	if_assert_fails(sec_buf_pos < sec_size)
+	job->sec_buf_pos = count - fill_size - written;
+	if_assert_fails(job->sec_buf_pos < sec_size)
 		return -1;
 
 	// Keep leftover bytes, if any, in the sector buffer
-	if (sec_buf_pos != 0)
-		memcpy(sec_buf, &buf[fill_size + written], sec_buf_pos);
+	if (job->sec_buf_pos != 0)
+		memcpy(job->sec_buf, &buf[fill_size + written], job->sec_buf_pos);
 	return (int)count;
 }
 
+/*
+ * Write a block of data at offset on the target of a write job, with retries.
+ * Apart from cancellation, this only relies on the job it is passed.
+ */
+static BOOL WriteBlock(write_job_t* job, const uint8_t* buf, DWORD size, uint64_t offset)
+{
+	BOOL s;
+	LARGE_INTEGER li;
+	DWORD i, write_size;
+
+	for (i = 1; i <= WRITE_RETRIES; i++) {
+		CHECK_FOR_USER_CANCEL;
+		s = WriteFile(job->hDrive, buf, size, &write_size, NULL);
+		if ((s) && (write_size == size))
+			return TRUE;
+		if (s)
+			uprintf("\r\nWrite error: Wrote %d bytes, expected %d bytes", write_size, size);
+		else
+			uprintf("\r\nWrite error at sector %lld: %s", offset / job->sector_size, WindowsErrorString());
+		if (i < WRITE_RETRIES) {
+			li.QuadPart = offset;
+			uprintf("Retrying in %d seconds...", WRITE_TIMEOUT / 1000);
+			Sleep(WRITE_TIMEOUT);
+			if (!SetFilePointerEx(job->hDrive, li, NULL, FILE_BEGIN)) {
+				uprintf("Write error: Could not reset position - %s", WindowsErrorString());
+				return FALSE;
+			}
+		} else {
+			ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
+			return FALSE;
+		}
+		Sleep(200);
+	}
+out:
+	return FALSE;
+}
+
+// Set up a write job for a target drive, including its cached write size, if any
+static void InitWriteJob(write_job_t* job, HANDLE hDrive, DWORD device_number, uint64_t disk_size, DWORD sector_size)
+{
+	int i;
+	char* cached_id;
+
+	memset(job, 0, sizeof(write_job_t));
+	job->hDrive = hDrive;
+	job->disk_size = disk_size;
+	job->sector_size = sector_size;
+	QueryPerformanceFrequency(&job->tuning.freq);
+	for (i = 0; (i < MAX_DRIVES) && (rufus_drive[i].size != 0); i++) {
+		if (rufus_drive[i].index == device_number) {
+			job->device_id = rufus_drive[i].id;
+			break;
+		}
+	}
+	cached_id = ReadSettingStr(SETTING_WRITE_TUNING_DEVICE);
+	if ((job->device_id != NULL) && (safe_strcmp(cached_id, job->device_id) == 0)) {
+		job->tuning.chunk_size = (DWORD)ReadSetting32(SETTING_WRITE_TUNING_SIZE);
+		for (i = 0; (i < WRITE_TUNING_SIZES) && (write_chunk_size[i] != job->tuning.chunk_size); i++);
+		if (i < WRITE_TUNING_SIZES)
+			uprintf("Using the %s write size previously measured for this device",
+				SizeToHumanReadable(job->tuning.chunk_size, FALSE, FALSE));
+		else
+			job->tuning.chunk_size = 0;
+	}
+}
+
+/*
+ * Pick the candidate with the lowest median duration, and return it only if its slowest
+ * round was still faster than the fastest round of the default size. Returns -1 otherwise.
+ */
+static int GetWriteTuningResult(write_job_t* job)
+{
+	int i, j, k, best = WRITE_TUNING_DEFAULT;
+	uint64_t tmp, median[WRITE_TUNING_SIZES];
+	uint64_t sorted[WRITE_TUNING_SIZES][WRITE_TUNING_ROUNDS];
+
+	for (i = 0; i < WRITE_TUNING_SIZES; i++) {
+		memcpy(sorted[i], job->tuning.duration[i], sizeof(sorted[i]));
+		for (j = 1; j < WRITE_TUNING_ROUNDS; j++) {
+			for (k = j; (k > 0) && (sorted[i][k - 1] > sorted[i][k]); k--) {
+				tmp = sorted[i][k];
+				sorted[i][k] = sorted[i][k - 1];
+				sorted[i][k - 1] = tmp;
+			}
+		}
+		median[i] = sorted[i][WRITE_TUNING_ROUNDS / 2];
+		// SizeToHumanReadable() uses a static buffer, so it can only be called once per uprintf()
+		uprintf("● %d MB: %s/s (%llu%% spread)", write_chunk_size[i] / MB,
+			SizeToHumanReadable(DD_BUFFER_SIZE * job->tuning.freq.QuadPart / MAX(median[i], 1), FALSE, FALSE),
+			100 * (sorted[i][WRITE_TUNING_ROUNDS - 1] - sorted[i][0]) / MAX(median[i], 1));
+		if (median[i] < median[best])
+			best = i;
+	}
+	if ((best != WRITE_TUNING_DEFAULT) &&
+		(sorted[best][WRITE_TUNING_ROUNDS - 1] >= sorted[WRITE_TUNING_DEFAULT][0]))
+		return -1;
+	return best;
+}
+
+/*
+ * Write a DD block, split into writes of the tuned size, and collect the duration
+ * for the candidate size being measured if we are still tuning.
+ */
+static BOOL WriteTunedBlock(write_job_t* job, const uint8_t* buf, DWORD size, uint64_t offset)
+{
+	int best, index = WRITE_TUNING_DEFAULT, round = 0;
+	DWORD pos, chunk_size;
+	LARGE_INTEGER start, end;
+
+	if ((job->tuning.chunk_size == 0) && (job->tuning.sample != 0)) {
+		index = (job->tuning.sample - 1) % WRITE_TUNING_SIZES;
+		round = (job->tuning.sample - 1) / WRITE_TUNING_SIZES;
+	}
+	chunk_size = (job->tuning.chunk_size != 0) ? job->tuning.chunk_size : write_chunk_size[index];
+	QueryPerformanceCounter(&start);
+	for (pos = 0; pos < size; pos += chunk_size) {
+		if (!WriteBlock(job, &buf[pos], MIN(chunk_size, size - pos), offset + pos))
+			return FALSE;
+	}
+	QueryPerformanceCounter(&end);
+
+	// Only full buffers are representative enough for measurement
+	if ((job->tuning.chunk_size != 0) || (size < DD_BUFFER_SIZE))
+		return TRUE;
+	if (job->tuning.sample++ != 0)
+		job->tuning.duration[index][round] = end.QuadPart - start.QuadPart;
+	if (job->tuning.sample <= WRITE_TUNING_SIZES * WRITE_TUNING_ROUNDS)
+		return TRUE;
+
+	uprintf("\r\nWrite size tuning:");
+	best = GetWriteTuningResult(job);
+	if (best < 0) {
+		job->tuning.chunk_size = write_chunk_size[WRITE_TUNING_DEFAULT];
+		uprintf("No write size was consistently faster - using %s writes",
+			SizeToHumanReadable(job->tuning.chunk_size, FALSE, FALSE));
+		return TRUE;
+	}
+	job->tuning.chunk_size = write_chunk_size[best];
+	uprintf("Using %s writes for the rest of the operation", SizeToHumanReadable(job->tuning.chunk_size, FALSE, FALSE));
+	if (job->device_id != NULL) {
+		WriteSettingStr(SETTING_WRITE_TUNING_DEVICE, (char*)job->device_id);
+		WriteSetting32(SETTING_WRITE_TUNING_SIZE, (int32_t)job->tuning.chunk_size);
+	}
+	return TRUE;
+}
+
 /* Write an image file or zero a drive */
 static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 {
@@ -1154,48 +1366,51 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 	LARGE_INTEGER li;
 	HANDLE hSourceImage = INVALID_HANDLE_VALUE;
 	DWORD i, read_size[NUM_BUFFERS] = { 0 }, write_size, comp_size, buf_size;
-	uint64_t wb, target_size = bZeroDrive ? SelectedDrive.DiskSize : MIN((uint64_t)SelectedDrive.DiskSize, img_report.image_size);
+	uint64_t wb, target_size;
 	int64_t bled_ret;
 	uint8_t* buffer = NULL;
 	uint32_t zero_data, *cmp_buffer = NULL;
 	char* vhd_path = NULL;
 	int throttle_fast_zeroing = 0, read_bufnum = 0, proc_bufnum = 1;
+	write_job_t job;
 
 	if (SelectedDrive.SectorSize < 512) {
 		uprintf("Unexpected sector size (%d) - Aborting", SelectedDrive.SectorSize);
 		return FALSE;
 	}
+	InitWriteJob(&job, hPhysicalDrive, SelectedDrive.DeviceNumber, SelectedDrive.DiskSize, SelectedDrive.SectorSize);
+	target_size = bZeroDrive ? job.disk_size : MIN(job.disk_size, img_report.image_size);
 
 	// We poked the MBR and other stuff, so we need to rewind
 	li.QuadPart = 0;
-	if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN))
+	if (!SetFilePointerEx(job.hDrive, li, NULL, FILE_BEGIN))
 		uprintf("WARNING: Unable to rewind image position - wrong data might be copied!");
 	UpdateProgressWithInfoInit(NULL, FALSE);
 
 	if (bZeroDrive) {
 		uprintf(fast_zeroing ? "Fast-zeroing drive:" : "Zeroing drive:");
 		// Our buffer size must be a multiple of the sector size and *ALIGNED* to the sector size
-		buf_size = ((DD_BUFFER_SIZE + SelectedDrive.SectorSize - 1) / SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
-		buffer = (uint8_t*)_mm_malloc(buf_size, SelectedDrive.SectorSize);
+		buf_size = ((DD_BUFFER_SIZE + job.sector_size - 1) / job.sector_size) * job.sector_size;
+		buffer = (uint8_t*)_mm_malloc(buf_size, job.sector_size);
 		if (buffer == NULL) {
 			ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
 			uprintf("Could not allocate disk zeroing buffer");
 			goto out;
 		}
-		if_assert_fails((uintptr_t)buffer % SelectedDrive.SectorSize == 0)
+		if_assert_fails((uintptr_t)buffer % job.sector_size == 0)
 			goto out;
 
 		// Clear buffer
 		memset(buffer, fast_zeroing ? 0xff : 0x00, buf_size);
 
 		if (fast_zeroing) {
-			cmp_buffer = (uint32_t*)_mm_malloc(buf_size, SelectedDrive.SectorSize);
+			cmp_buffer = (uint32_t*)_mm_malloc(buf_size, job.sector_size);
 			if (cmp_buffer == NULL) {
 				ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
 				uprintf("Could not allocate disk comparison buffer");
 				goto out;
 			}
-			if_assert_fails((uintptr_t)cmp_buffer % SelectedDrive.SectorSize == 0)
+			if_assert_fails((uintptr_t)cmp_buffer % job.sector_size == 0)
 				goto out;
 		}
 
@@ -1209,8 +1424,8 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 				read_size[0] = (DWORD)(target_size - wb);
 
 			// WriteFile fails unless the size is a multiple of sector size
-			if (read_size[0] % SelectedDrive.SectorSize != 0)
-				read_size[0] = ((read_size[0] + SelectedDrive.SectorSize - 1) / SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
+			if (read_size[0] % job.sector_size != 0)
+				read_size[0] = ((read_size[0] + job.sector_size - 1) / job.sector_size) * job.sector_size;
 
 			// Fast-zeroing: Depending on your hardware, reading from flash may be much faster than writing, so
 			// we might speed things up by skipping empty blocks, or skipping the write if the data is the same.
@@ -1222,7 +1437,7 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 				CHECK_FOR_USER_CANCEL;
 
 				// Read block and compare against the block that needs to be written
-				s = ReadFile(hPhysicalDrive, cmp_buffer, read_size[0], &comp_size, NULL);
+				s = ReadFile(job.hDrive, cmp_buffer, read_size[0], &comp_size, NULL);
 				if ((!s) || (comp_size != read_size[0])) {
 					uprintf("\r\nRead error: Could not read data for fast zeroing comparison - %s", WindowsErrorString());
 					goto out;
@@ -1243,7 +1458,7 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 
 				// Move the file pointer position back for writing
 				li.QuadPart = wb;
-				if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
+				if (!SetFilePointerEx(job.hDrive, li, NULL, FILE_BEGIN)) {
 					uprintf("\r\nError: Could not reset position - %s", WindowsErrorString());
 					goto out;
 				}
@@ -1251,31 +1466,9 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 				throttle_fast_zeroing = 15;
 			}
 
-			for (i = 1; i <= WRITE_RETRIES; i++) {
-				CHECK_FOR_USER_CANCEL;
-				s = WriteFile(hPhysicalDrive, buffer, read_size[0], &write_size, NULL);
-				if ((s) && (write_size == read_size[0]))
-					break;
-				if (s)
-					uprintf("\r\nWrite error: Wrote %d bytes, expected %d bytes", write_size, read_size[0]);
-				else
-					uprintf("\r\nWrite error at sector %lld: %s", wb / SelectedDrive.SectorSize, WindowsErrorString());
-				if (i < WRITE_RETRIES) {
-					li.QuadPart = wb;
-					uprintf("Retrying in %d seconds...", WRITE_TIMEOUT / 1000);
-					Sleep(WRITE_TIMEOUT);
-					if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
-						uprintf("Write error: Could not reset position - %s", WindowsErrorString());
-						goto out;
-					}
-				} else {
-					ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
-					goto out;
-				}
-				Sleep(200);
-			}
-			if (i > WRITE_RETRIES)
+			if (!WriteTunedBlock(&job, buffer, read_size[0], wb))
 				goto out;
+			write_size = read_size[0];
 		}
 		uprintfs("\r\n");
 	} else if (img_report.compression_type != BLED_COMPRESSION_NONE && img_report.compression_type < BLED_COMPRESSION_MAX) {
@@ -1287,28 +1480,29 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 			ErrorStatus = RUFUS_ERROR(ERROR_OPEN_FAILED);
 			goto out;
 		}
-		sec_buf = (uint8_t*)_mm_malloc(SelectedDrive.SectorSize, SelectedDrive.SectorSize);
-		if (sec_buf == NULL) {
+		job.sec_buf = (uint8_t*)_mm_malloc(job.sector_size, job.sector_size);
+		if (job.sec_buf == NULL) {
 			ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
 			uprintf("Could not allocate disk write buffer");
 			goto out;
 		}
-		if_assert_fails((uintptr_t)sec_buf% SelectedDrive.SectorSize == 0)
+		if_assert_fails((uintptr_t)job.sec_buf % job.sector_size == 0)
 			goto out;
-		sec_buf_pos = 0;
+		bled_write_job = &job;
 		bled_init(256 * KB, uprintf, NULL, sector_write, update_progress, NULL, &ErrorStatus);
-		bled_ret = bled_uncompress_with_handles(hSourceImage, hPhysicalDrive, img_report.compression_type);
+		bled_ret = bled_uncompress_with_handles(hSourceImage, job.hDrive, img_report.compression_type);
 		bled_exit();
+		bled_write_job = NULL;
 		uprintfs("\r\n");
-		if ((bled_ret >= 0) && (sec_buf_pos != 0)) {
+		if ((bled_ret >= 0) && (job.sec_buf_pos != 0)) {
 			// A disk image that doesn't end up on disk boundary should be a rare
 			// enough case, so we dont bother checking the write operation and
 			// just issue a notice about it in the log.
 			uprintf("Notice: Compressed image data didn't end on block boundary.");
 			// Gonna assert that WriteFile() and _write() share the same file offset
-			WriteFile(hPhysicalDrive, sec_buf, SelectedDrive.SectorSize, &write_size, NULL);
+			WriteFile(job.hDrive, job.sec_buf, job.sector_size, &write_size, NULL);
 		}
-		safe_mm_free(sec_buf);
+		safe_mm_free(job.sec_buf);
 		if ((bled_ret < 0) && (SCODE_CODE(ErrorStatus) != ERROR_CANCELLED)) {
 			// Unfortunately, different compression backends return different negative error codes
 			uprintf("Could not write compressed image: %lld", bled_ret);
@@ -1336,14 +1530,14 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 		}
 
 		// Our buffer size must be a multiple of the sector size and *ALIGNED* to the sector size
-		buf_size = ((DD_BUFFER_SIZE + SelectedDrive.SectorSize - 1) / SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
-		buffer = (uint8_t*)_mm_malloc(buf_size * NUM_BUFFERS, SelectedDrive.SectorSize);
+		buf_size = ((DD_BUFFER_SIZE + job.sector_size - 1) / job.sector_size) * job.sector_size;
+		buffer = (uint8_t*)_mm_malloc(buf_size * NUM_BUFFERS, job.sector_size);
 		if (buffer == NULL) {
 			ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
 			uprintf("Could not allocate disk write buffer");
 			goto out;
 		}
-		if_assert_fails((uintptr_t)buffer% SelectedDrive.SectorSize == 0)
+		if_assert_fails((uintptr_t)buffer% job.sector_size == 0)
 			goto out;
 
 		// Start the initial read
@@ -1369,10 +1563,10 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 
 
 			// 2. WriteFile fails unless the size is a multiple of sector size
-			if (read_size[read_bufnum] % SelectedDrive.SectorSize != 0) {
-				if_assert_fails(CEILING_ALIGN(read_size[read_bufnum], SelectedDrive.SectorSize) <= buf_size)
+			if (read_size[read_bufnum] % job.sector_size != 0) {
+				if_assert_fails(CEILING_ALIGN(read_size[read_bufnum], job.sector_size) <= buf_size)
 					goto out;
-				read_size[read_bufnum] = CEILING_ALIGN(read_size[read_bufnum], SelectedDrive.SectorSize);
+				read_size[read_bufnum] = CEILING_ALIGN(read_size[read_bufnum], job.sector_size);
 			}
 
 			// 3. Switch to the next reading buffer
@@ -1389,35 +1583,12 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 			ReadFileAsync(hSourceImage, &buffer[read_bufnum * buf_size], (DWORD)MIN(buf_size, target_size - (wb + read_size[proc_bufnum])));
 
 			// 4. Synchronously write the current data buffer
-			for (i = 1; i <= WRITE_RETRIES; i++) {
-				CHECK_FOR_USER_CANCEL;
-				s = WriteFile(hPhysicalDrive, &buffer[proc_bufnum * buf_size], read_size[proc_bufnum], &write_size, NULL);
-				if ((s) && (write_size == read_size[proc_bufnum]))
-					break;
-				if (s)
-					uprintf("\r\nWrite error: Wrote %d bytes, expected %d bytes", write_size, read_size[proc_bufnum]);
-				else
-					uprintf("\r\nWrite error at sector %lld: %s", wb / SelectedDrive.SectorSize, WindowsErrorString());
-				if (i < WRITE_RETRIES) {
-					li.QuadPart = wb;
-					uprintf("Retrying in %d seconds...", WRITE_TIMEOUT / 1000);
-					Sleep(WRITE_TIMEOUT);
-					if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
-						uprintf("Write error: Could not reset position - %s", WindowsErrorString());
-						goto out;
-					}
-				} else {
-					ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
-					goto out;
-				}
-				Sleep(200);
-			}
-			if (i > WRITE_RETRIES)
+			if (!WriteTunedBlock(&job, &buffer[proc_bufnum * buf_size], read_size[proc_bufnum], wb))
 				goto out;
 		}
 		uprintfs("\r\n");
 	}
-	RefreshDriveLayout(hPhysicalDrive);
+	RefreshDriveLayout(job.hDrive);
 	ret = TRUE;
 out:
 	if (img_report.compression_type != BLED_COMPRESSION_NONE && img_report.compression_type < BLED_COMPRESSION_MAX)
@@ -1428,9 +1599,96 @@ out:
 		VhdUnmountImage();
 	safe_mm_free(buffer);
 	safe_mm_free(cmp_buffer);
+	safe_mm_free(job.sec_buf);
 	return ret;
 }
 
+/*
+ * Create a log file for the bad blocks report. Since %USERPROFILE% may
+ * have localized characters, we use the UTF-8 API.
+ */
+static FILE* OpenBadBlocksLog(char* logfile, size_t logfile_size)
+{
+	FILE* log_fd;
+	char* userdir;
+	SYSTEMTIME lt;
+
+	userdir = getenvU("USERPROFILE");
+	safe_strcpy(logfile, logfile_size, userdir);
+	safe_free(userdir);
+	GetLocalTime(&lt);
+	safe_sprintf(&logfile[strlen(logfile)], logfile_size - strlen(logfile) - 1,
+		"\\rufus_%04d%02d%02d_%02d%02d%02d.log",
+		lt.wYear, lt.wMonth, lt.wDay, lt.wHour, lt.wMinute, lt.wSecond);
+	log_fd = fopenU(logfile, "w+");
+	if (log_fd == NULL) {
+		uprintf("Error: Could not create log file for bad blocks check");
+		return NULL;
+	}
+	fprintf(log_fd, APPLICATION_NAME " bad blocks check started on: %04d.%02d.%02d %02d:%02d:%02d",
+		lt.wYear, lt.wMonth, lt.wDay, lt.wHour, lt.wMinute, lt.wSecond);
+	fflush(log_fd);
+	return log_fd;
+}
+
+/*
+ * Per phase timings, to find out where the time goes when an operation is slow.
+ * These are only ever called from the format thread and do nothing unless USB
+ * debug is enabled. The CPU time is the one from the format thread only.
+ */
+static uint64_t GetThreadCpuTime(void)
+{
+	FILETIME creation_time, exit_time, kernel_time, user_time;
+
+	if (!GetThreadTimes(GetCurrentThread(), &creation_time, &exit_time, &kernel_time, &user_time))
+		return 0;
+	// FILETIME values are expressed in 100 ns units
+	return ((((uint64_t)kernel_time.dwHighDateTime << 32) | kernel_time.dwLowDateTime) +
+		(((uint64_t)user_time.dwHighDateTime << 32) | user_time.dwLowDateTime)) / 10000;
+}
+
+static void PhaseStart(enum format_phase phase)
+{
+	if (!usb_debug)
+		return;
+	phase_time[phase].start = GetTickCount64();
+	phase_time[phase].cpu_start = GetThreadCpuTime();
+}
+
+static void PhaseEnd(enum format_phase phase)
+{
+	if (!usb_debug || phase_time[phase].start == 0)
+		return;
+	phase_time[phase].wall += GetTickCount64() - phase_time[phase].start;
+	phase_time[phase].cpu += GetThreadCpuTime() - phase_time[phase].cpu_start;
+	phase_time[phase].start = 0;
+	phase_time[phase].count++;
+}
+
+static void PrintPhaseTimings(void)
+{
+	int i;
+	uint64_t total_time = 0;
+
+	if (!usb_debug)
+		return;
+	for (i = 0; i < PHASE_MAX; i++) {
+		// Close any phase we may have left early on error
+		PhaseEnd(i);
+		total_time += phase_time[i].wall;
+	}
+	if (total_time == 0)
+		return;
+	uprintf("Phase timings:");
+	for (i = 0; i < PHASE_MAX; i++) {
+		if (phase_time[i].count == 0)
+			continue;
+		uprintf("● %s: %llu ms (%d%%), %llu ms CPU, %u pass%s", phase_name[i], phase_time[i].wall,
+			(int)(100 * phase_time[i].wall / total_time), phase_time[i].cpu,
+			phase_time[i].count, (phase_time[i].count > 1) ? "es" : "");
+	}
+}
+
 /*
  * Standalone thread for the formatting operation
  * According to https://learn.microsoft.com/windows/win32/api/winioctl/ni-winioctl-fsctl_dismount_volume
@@ -1458,11 +1716,12 @@ DWORD WINAPI FormatThread(void* param)
 	char *bb_msg, *volume_name = NULL;
 	char drive_name[] = "?:\\";
 	char drive_letters[27], fs_name[32], label[64];
-	char logfile[MAX_PATH], *userdir;
+	char logfile[MAX_PATH];
 	char efi_dst[] = "?:\\efi\\boot\\bootx64.efi";
 	char kolibri_dst[] = "?:\\MTLD_F32";
 	char grub4dos_dst[] = "?:\\grldr";
 
+	memset(phase_time, 0, sizeof(phase_time));
 	windows_to_go = (image_options & IMOP_WINTOGO) && (boot_type == BT_IMAGE) && HAS_WINTOGO(img_report) &&
 		(ComboBox_GetCurItemData(hImageOption) == IMOP_WIN_TO_GO);
 	large_drive = (SelectedDrive.DiskSize > (1*TB));
@@ -1576,10 +1835,13 @@ DWORD WINAPI FormatThread(void* param)
 	}
 
 	if (zero_drive) {
+		PhaseStart(PHASE_WRITE_DRIVE);
 		WriteDrive(hPhysicalDrive, TRUE);
+		PhaseEnd(PHASE_WRITE_DRIVE);
 		goto out;
 	}
 
+	PhaseStart(PHASE_PARTITION);
 try_clear:
 	// Zap partition records. This may help prevent access errors.
 	// Note, Microsoft's way of cleaning partitions (IOCTL_DISK_CREATE_DISK, which is what we apply
@@ -1612,29 +1874,50 @@ try_clear:
 			goto out;
 		}
 	}
+	PhaseEnd(PHASE_PARTITION);
 
 	if (IsChecked(IDC_BAD_BLOCKS)) {
+		PhaseStart(PHASE_BADBLOCKS);
+		// A full check of a fake drive can take hours before it gets reported,
+		// so start with a quick probe of the capacity.
+		if (detect_fakes) {
+			capacity_report cap_report;
+			do {
+				FILE* log_fd;
+				r = IDOK;
+				if (!ProbeCapacity(hPhysicalDrive, SelectedDrive.DiskSize, SelectedDrive.SectorSize, FALSE, &cap_report) ||
+					(cap_report.real_size >= SelectedDrive.DiskSize))
+					break;
+				log_fd = OpenBadBlocksLog(logfile, sizeof(logfile));
+				if (log_fd == NULL)
+					goto out;
+				// Report the unusable part of the drive as bad blocks, and the sectors
+				// that read back the data of another sector as corruption errors.
+				bb_msg = lmprintf(MSG_011, (int)MIN((SelectedDrive.DiskSize - cap_report.real_size) / BADBLOCK_BLOCK_SIZE,
+					INT_MAX), cap_report.nb_bad, 0, cap_report.nb_aliased);
+				fprintf(log_fd, "\nCapacity probe: %d sector(s) probed, %d lost their data, %d returned another sector's data",
+					cap_report.nb_probes, cap_report.nb_bad, cap_report.nb_aliased);
+				fprintf(log_fd, "\nReported size: %s", SizeToHumanReadable(SelectedDrive.DiskSize, FALSE, FALSE));
+				fprintf(log_fd, "\nUsable size: %s\n", SizeToHumanReadable(cap_report.real_size, FALSE, FALSE));
+				fprintf(log_fd, "%s", bb_msg);
+				GetLocalTime(&lt);
+				fprintf(log_fd, APPLICATION_NAME " bad blocks check ended on: %04d.%02d.%02d %02d:%02d:%02d",
+				lt.wYear, lt.wMonth, lt.wDay, lt.wHour, lt.wMinute, lt.wSecond);
+				fclose(log_fd);
+				r = Notification(MB_ABORTRETRYIGNORE | MB_ICONWARNING, lmprintf(MSG_010), lmprintf(MSG_012, bb_msg, logfile));
+			} while (r == IDRETRY);
+			if (r == IDABORT) {
+				ErrorStatus = RUFUS_ERROR(ERROR_CANCELLED);
+				goto out;
+			}
+			CHECK_FOR_USER_CANCEL;
+		}
 		do {
 			FILE* log_fd;
 			int sel = ComboBox_GetCurSel(hNBPasses);
-			// create a log file for bad blocks report. Since %USERPROFILE% may
-			// have localized characters, we use the UTF-8 API.
-			userdir = getenvU("USERPROFILE");
-			static_strcpy(logfile, userdir);
-			safe_free(userdir);
-			GetLocalTime(&lt);
-			safe_sprintf(&logfile[strlen(logfile)], sizeof(logfile) - strlen(logfile) - 1,
-				"\\rufus_%04d%02d%02d_%02d%02d%02d.log",
-				lt.wYear, lt.wMonth, lt.wDay, lt.wHour, lt.wMinute, lt.wSecond);
-			log_fd = fopenU(logfile, "w+");
-			if (log_fd == NULL) {
-				uprintf("Error: Could not create log file for bad blocks check");
+			log_fd = OpenBadBlocksLog(logfile, sizeof(logfile));
+			if (log_fd == NULL)
 				goto out;
-			} else {
-				fprintf(log_fd, APPLICATION_NAME " bad blocks check started on: %04d.%02d.%02d %02d:%02d:%02d",
-				lt.wYear, lt.wMonth, lt.wDay, lt.wHour, lt.wMinute, lt.wSecond);
-				fflush(log_fd);
-			}
 
 			if (!BadBlocks(hPhysicalDrive, SelectedDrive.DiskSize, (sel >= 2) ? 4 : sel +1, sel, &report, log_fd)) {
 				uprintf("Bad blocks: Check failed.");
@@ -1668,6 +1951,7 @@ try_clear:
 			ErrorStatus = RUFUS_ERROR(ERROR_CANCELLED);
 			goto out;
 		}
+		PhaseEnd(PHASE_BADBLOCKS);
 
 		// Especially after destructive badblocks test, you must zero the MBR/GPT completely
 		// before repartitioning. Else, all kind of bad things happen.
@@ -1681,6 +1965,7 @@ try_clear:
 
 	// Write an image file
 	if ((boot_type == BT_IMAGE) && write_as_image) {
+		PhaseStart(PHASE_WRITE_DRIVE);
 		// Special case for FFU images
 		if (img_report.compression_type == IMG_COMPRESSION_FFU) {
 			char cmd[MAX_PATH + 128], *physical = NULL;
@@ -1701,17 +1986,20 @@ try_clear:
 		} else {
 			WriteDrive(hPhysicalDrive, FALSE);
 		}
+		PhaseEnd(PHASE_WRITE_DRIVE);
 		goto out;
 	}
 
 	UpdateProgress(OP_ZERO_MBR, -1.0f);
 	CHECK_FOR_USER_CANCEL;
 
+	PhaseStart(PHASE_PARTITION);
 	if (!CreatePartition(hPhysicalDrive, partition_type, fs_type, (partition_type == PARTITION_STYLE_MBR)
 		&& (target_type == TT_UEFI), extra_partitions)) {
 		ErrorStatus = (LastWriteError != 0) ? LastWriteError : RUFUS_ERROR(ERROR_PARTITION_FAILURE);
 		goto out;
 	}
+	PhaseEnd(PHASE_PARTITION);
 	UpdateProgress(OP_PARTITION, -1.0f);
 
 	// Close the (unmounted) volume before formatting
@@ -1751,6 +2039,7 @@ try_clear:
 	}
 
 	// Wait for the logical drive we just created to appear
+	PhaseStart(PHASE_WAIT_VOLUME);
 	uprintf("Waiting for logical drive to reappear...");
 	Sleep(200);
 	if (write_as_esp || write_as_ext) {
@@ -1768,10 +2057,12 @@ try_clear:
 			goto out;
 		}
 	}
+	PhaseEnd(PHASE_WAIT_VOLUME);
 	CHECK_FOR_USER_CANCEL;
 
 	// Format Casper partition if required. Do it before we format anything with
 	// a file system that Windows will recognize, to avoid concurrent access.
+	PhaseStart(PHASE_FORMAT);
 	if (extra_partitions & XP_PERSISTENCE) {
 		uint32_t ext_version = ReadSetting32(SETTING_USE_EXT_VERSION);
 		if ((ext_version < 2) || (ext_version > 4))
@@ -1811,6 +2102,7 @@ try_clear:
 		uprintf("Format error: %s", StrError(ErrorStatus, TRUE));
 		goto out;
 	}
+	PhaseEnd(PHASE_FORMAT);
 
 	if (must_unlock_physical) {
 		// Get RW access back to the physical drive...
@@ -1824,11 +2116,13 @@ try_clear:
 	// Thanks to Microsoft, we must fix the MBR AFTER the drive has been formatted
 	if ((partition_type == PARTITION_STYLE_MBR) || ((boot_type != BT_NON_BOOTABLE) && (partition_type == PARTITION_STYLE_GPT))) {
 		PrintInfoDebug(0, MSG_228);	// "Writing master boot record..."
+		PhaseStart(PHASE_BOOT_RECORDS);
 		if ((!WriteMBR(hPhysicalDrive)) || (!WriteSBR(hPhysicalDrive))) {
 			if (!IS_ERROR(ErrorStatus))
 				ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
 			goto out;
 		}
+		PhaseEnd(PHASE_BOOT_RECORDS);
 		UpdateProgress(OP_FIX_MBR, -1.0f);
 	}
 	Sleep(200);
@@ -1877,6 +2171,7 @@ try_clear:
 	}
 
 	if (boot_type != BT_NON_BOOTABLE) {
+		PhaseStart(PHASE_BOOT_RECORDS);
 		if (boot_type == BT_UEFI_NTFS) {
 			// All good
 		} else if (target_type == TT_UEFI) {
@@ -1912,6 +2207,7 @@ try_clear:
 			// We must close and unlock the volume to write files to it
 			safe_unlockclose(hLogicalVolume);
 		}
+		PhaseEnd(PHASE_BOOT_RECORDS);
 	} else {
 		if (IsChecked(IDC_EXTENDED_LABEL))
 			SetAutorun(drive_name);
@@ -1926,6 +2222,7 @@ try_clear:
 	CHECK_FOR_USER_CANCEL;
 
 	if (boot_type != BT_NON_BOOTABLE) {
+		PhaseStart(PHASE_FILE_COPY);
 		if ((boot_type == BT_MSDOS) || (boot_type == BT_FREEDOS)) {
 			UpdateProgress(OP_FILE_COPY, -1.0f);
 			PrintInfoDebug(0, MSG_230);
@@ -1951,9 +2248,12 @@ try_clear:
 						ErrorStatus = RUFUS_ERROR(APPERR(ERROR_ISO_EXTRACT));
 					goto out;
 				}
+				PhaseEnd(PHASE_FILE_COPY);
 				if (unattend_xml_path != NULL) {
+					PhaseStart(PHASE_CUSTOMIZE);
 					if (!ApplyWindowsCustomization(drive_name[0], unattend_xml_flags | UNATTEND_WINDOWS_TO_GO))
 						ErrorStatus = RUFUS_ERROR(APPERR(ERROR_CANT_PATCH));
+					PhaseEnd(PHASE_CUSTOMIZE);
 				}
 			} else {
 				if_assert_fails(!img_report.is_windows_img)
@@ -1994,15 +2294,20 @@ try_clear:
 					if (!SetupWinPE(drive_name[0]))
 						ErrorStatus = RUFUS_ERROR(APPERR(ERROR_CANT_PATCH));
 				}
+				PhaseEnd(PHASE_FILE_COPY);
 				if (unattend_xml_path != NULL) {
+					PhaseStart(PHASE_CUSTOMIZE);
 					if (!ApplyWindowsCustomization(drive_name[0], unattend_xml_flags))
 						ErrorStatus = RUFUS_ERROR(APPERR(ERROR_CANT_PATCH));
+					PhaseEnd(PHASE_CUSTOMIZE);
 				}
 			}
 		}
+		PhaseEnd(PHASE_FILE_COPY);
 
 		UpdateProgress(OP_FINALIZE, -1.0f);
 		PrintInfoDebug(0, MSG_233);
+		PhaseStart(PHASE_FINALIZE);
 		if ((boot_type == BT_IMAGE) && (image_path != NULL) && (img_report.is_iso) && (!windows_to_go))
 			UpdateMD5Sum(drive_name, md5sum_name[img_report.has_md5sum ? img_report.has_md5sum - 1 : 0]);
 		if (IsChecked(IDC_EXTENDED_LABEL))
@@ -2020,6 +2325,7 @@ try_clear:
 			CheckDisk(drive_name[0]);
 			UpdateProgress(OP_FINALIZE, -1.0f);
 		}
+		PhaseEnd(PHASE_FINALIZE);
 	}
 
 	// Copy any additonal files from an optional zip archive selected by the user
@@ -2036,8 +2342,11 @@ out:
 	else
 		safe_free(volume_name);
 	safe_free(buffer);
+	PhaseStart(PHASE_CLOSE);
 	safe_unlockclose(hLogicalVolume);
 	safe_unlockclose(hPhysicalDrive);	// This can take a while
+	PhaseEnd(PHASE_CLOSE);
+	PrintPhaseTimings();
 	if ((boot_type == BT_IMAGE) && write_as_image) {
 		PrintInfo(0, MSG_320, lmprintf(MSG_307));
 		Sleep(200);
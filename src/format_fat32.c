@@ -88,6 +88,23 @@ typedef struct {
 } FAT_FSINFO;
 #pragma pack(pop)
 
+// Sector that gets written as part of the system area zeroing stream
+typedef struct {
+	DWORD Sector;
+	void* Data;
+} FAT32_META_SECTOR;
+
+// System area initialization phase, for timing report
+typedef struct {
+	const char* Name;
+	DWORD Start;
+	DWORD Count;
+	uint64_t Duration;
+} FAT32_PHASE;
+
+#define FAT32_ZERO_BUFFER_MAX       (8 * MB)
+#define FAT32_ZERO_BUFFER_MIN       (64 * KB)
+
 /*
  * 28.2  CALCULATING THE VOLUME SERIAL NUMBER
  *
@@ -166,10 +183,11 @@ BOOL FormatLargeFAT32(DWORD DriveIndex, uint64_t PartitionOffset, DWORD ClusterS
 	DWORD BackupBootSect = 6;
 	DWORD VolumeId = 0; // calculated before format
 	char* VolumeName = NULL;
-	DWORD BurstSize = 128; // Zero in blocks of 64K typically
+	DWORD BurstSize, Burst, Sector, Written;
 
 	// Calculated later
 	DWORD FatSize = 0;
+	DWORD j, nMetaSect = 0;
 	DWORD BytesPerSect = 0;
 	DWORD SectorsPerCluster = 0;
 	DWORD TotalSectors = 0;
@@ -183,6 +201,8 @@ BOOL FormatLargeFAT32(DWORD DriveIndex, uint64_t PartitionOffset, DWORD ClusterS
 	FAT_FSINFO* pFAT32FsInfo = NULL;
 	DWORD* pFirstSectOfFat = NULL;
 	BYTE* pZeroSect = NULL;
+	FAT32_META_SECTOR MetaSect[4 + 2];
+	FAT32_PHASE Phase[2 + 2];
 	char VolId[12] = "NO NAME    ";
 
 	// Debug temp vars
@@ -416,36 +436,78 @@ BOOL FormatLargeFAT32(DWORD DriveIndex, uint64_t PartitionOffset, DWORD ClusterS
 
 	// First zero out ReservedSect + FatSize * NumFats + SectorsPerCluster
 	SystemAreaSize = ReservedSectCount + (NumFATs * FatSize) + SectorsPerCluster;
-	uprintf("Clearing out %d sectors for reserved sectors, FATs and root cluster...", SystemAreaSize);
-
-	// Not the most effective, but easy on RAM
-	pZeroSect = (BYTE*)calloc(BytesPerSect, BurstSize);
-	if (!pZeroSect) {
+	uprintf("Initializing %d sectors for reserved sectors, FATs and root cluster...", SystemAreaSize);
+
+	// Use the largest aligned buffer we can get, within reason, as the FATs of a large
+	// volume can be close to 500 MB and small bursts leave the device mostly idle.
+	BurstSize = (DWORD)MIN(FAT32_ZERO_BUFFER_MAX / BytesPerSect, SystemAreaSize);
+	for (; BurstSize >= FAT32_ZERO_BUFFER_MIN / BytesPerSect; BurstSize /= 2) {
+		pZeroSect = (BYTE*)_mm_malloc((size_t)BytesPerSect * BurstSize, BytesPerSect);
+		if (pZeroSect != NULL)
+			break;
+	}
+	if (pZeroSect == NULL)
 		die("Failed to allocate memory", ERROR_NOT_ENOUGH_MEMORY);
+	memset(pZeroSect, 0, (size_t)BytesPerSect * BurstSize);
+
+	// The boot sectors, FSInfo sectors and FAT heads are merged into the zero stream
+	// rather than written separately once the system area has been cleared.
+	MetaSect[nMetaSect].Sector = 0;
+	MetaSect[nMetaSect++].Data = pFAT32BootSect;
+	MetaSect[nMetaSect].Sector = 1;
+	MetaSect[nMetaSect++].Data = pFAT32FsInfo;
+	MetaSect[nMetaSect].Sector = BackupBootSect;
+	MetaSect[nMetaSect++].Data = pFAT32BootSect;
+	MetaSect[nMetaSect].Sector = BackupBootSect + 1;
+	MetaSect[nMetaSect++].Data = pFAT32FsInfo;
+	for (i = 0; i < NumFATs; i++) {
+		uprintf("FAT #%d sector at address: %d", i, ReservedSectCount + (i * FatSize));
+		MetaSect[nMetaSect].Sector = ReservedSectCount + (i * FatSize);
+		MetaSect[nMetaSect++].Data = pFirstSectOfFat;
 	}
 
-	for (i = 0; i < (SystemAreaSize + BurstSize - 1); i += BurstSize) {
-		if (!(Flags & FP_NO_PROGRESS))
-			UpdateProgressWithInfo(OP_FORMAT, MSG_217, (uint64_t)i, (uint64_t)SystemAreaSize + BurstSize);
-		CHECK_FOR_USER_CANCEL;
-		if (write_sectors(hLogicalVolume, BytesPerSect, i, BurstSize, pZeroSect) != (BytesPerSect * BurstSize)) {
-			die("Error clearing reserved sectors", ERROR_WRITE_FAULT);
-		}
+	Phase[0].Name = "Reserved sectors";
+	Phase[0].Start = 0;
+	Phase[0].Count = ReservedSectCount;
+	for (i = 0; i < NumFATs; i++) {
+		Phase[i + 1].Name = "FAT";
+		Phase[i + 1].Start = ReservedSectCount + (i * FatSize);
+		Phase[i + 1].Count = FatSize;
 	}
-
-	uprintf ("Initializing reserved sectors and FATs...");
-	// Now we should write the boot sector and fsinfo twice, once at 0 and once at the backup boot sect position
-	for (i = 0; i < 2; i++) {
-		int SectorStart = (i == 0) ? 0 : BackupBootSect;
-		write_sectors(hLogicalVolume, BytesPerSect, SectorStart, 1, pFAT32BootSect);
-		write_sectors(hLogicalVolume, BytesPerSect, SectorStart + 1, 1, pFAT32FsInfo);
+	Phase[NumFATs + 1].Name = "Root cluster";
+	Phase[NumFATs + 1].Start = ReservedSectCount + (NumFATs * FatSize);
+	Phase[NumFATs + 1].Count = SectorsPerCluster;
+
+	for (i = 0, Written = 0; i < NumFATs + 2; i++) {
+		Phase[i].Duration = GetTickCount64();
+		for (Sector = Phase[i].Start; Sector < Phase[i].Start + Phase[i].Count; Sector += Burst) {
+			if (!(Flags & FP_NO_PROGRESS))
+				UpdateProgressWithInfo(OP_FORMAT, MSG_217, (uint64_t)Written, (uint64_t)SystemAreaSize);
+			CHECK_FOR_USER_CANCEL;
+			Burst = MIN(BurstSize, Phase[i].Start + Phase[i].Count - Sector);
+			for (j = 0; j < nMetaSect; j++) {
+				if (MetaSect[j].Sector >= Sector && MetaSect[j].Sector < Sector + Burst)
+					memcpy(&pZeroSect[(MetaSect[j].Sector - Sector) * BytesPerSect], MetaSect[j].Data, BytesPerSect);
+			}
+			if (write_sectors(hLogicalVolume, BytesPerSect, Sector, Burst, pZeroSect) != (int64_t)BytesPerSect * Burst)
+				die("Error initializing reserved sectors and FATs", ERROR_WRITE_FAULT);
+			for (j = 0; j < nMetaSect; j++) {
+				if (MetaSect[j].Sector >= Sector && MetaSect[j].Sector < Sector + Burst)
+					memset(&pZeroSect[(MetaSect[j].Sector - Sector) * BytesPerSect], 0, BytesPerSect);
+			}
+			Written += Burst;
+		}
+		Phase[i].Duration = GetTickCount64() - Phase[i].Duration;
 	}
 
-	// Write the first fat sector in the right places
-	for (i = 0; i < NumFATs; i++) {
-		int SectorStart = ReservedSectCount + (i * FatSize);
-		uprintf("FAT #%d sector at address: %d", i, SectorStart);
-		write_sectors(hLogicalVolume, BytesPerSect, SectorStart, 1, pFirstSectOfFat);
+	uprintf("System area initialization (%s bursts):", SizeToHumanReadable((uint64_t)BytesPerSect * BurstSize, FALSE, FALSE));
+	for (i = 0; i < NumFATs + 2; i++) {
+		if (i == 0 || i == NumFATs + 1)
+			uprintf("● %s: %s in %llu ms", Phase[i].Name,
+				SizeToHumanReadable((uint64_t)Phase[i].Count * BytesPerSect, FALSE, FALSE), Phase[i].Duration);
+		else
+			uprintf("● %s #%d: %s in %llu ms", Phase[i].Name, i - 1,
+				SizeToHumanReadable((uint64_t)Phase[i].Count * BytesPerSect, FALSE, FALSE), Phase[i].Duration);
 	}
 
 	if (!(Flags & FP_NO_BOOT)) {
@@ -482,6 +544,6 @@ out:
 	safe_free(pFAT32BootSect);
 	safe_free(pFAT32FsInfo);
 	safe_free(pFirstSectOfFat);
-	safe_free(pZeroSect);
+	safe_mm_free(pZeroSect);
 	return r;
 }
@@ -76,6 +76,7 @@
 #include "missing.h"
 #include "darkmode.h"
 #include "resource.h"
+#include "settings.h"
 #include "msapi_utf8.h"
 #include "localization.h"
 
@@ -2224,25 +2225,52 @@ static BOOL IsRevokedBySbat(uint8_t* buf, uint32_t len)
 	return FALSE;
 }
 
+/*
+ * Compiled DBX: the SHA-256 hashes from the DBX of each arch, sorted so that they can be
+ * looked up with a binary search. These are kept until the DBX timestamp in the settings
+ * changes, which only happens when CheckForDBXUpdates() downloads a newer DBX.
+ */
+static struct {
+	uint8_t* hash;
+	uint32_t count;
+	uint64_t timestamp;
+	BOOL compiled;
+} dbx_db[ARCH_MAX] = { 0 };
+
+static int cmp_sha256(const void* arg1, const void* arg2)
+{
+	return memcmp(arg1, arg2, SHA256_HASHSIZE);
+}
+
+void FreeDbx(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAYSIZE(dbx_db); i++)
+		free(dbx_db[i].hash);
+	memset(dbx_db, 0, sizeof(dbx_db));
+}
+
 // NB: Can be tested using en_windows_8_1_x64_dvd_2707217.iso
 extern BOOL UseLocalDbx(int arch);
-static BOOL IsRevokedByDbx(uint8_t* hash, uint8_t* buf, uint32_t len)
+static BOOL CompileDbx(int arch, uint64_t timestamp)
 {
 	EFI_VARIABLE_AUTHENTICATION_2* efi_var_auth;
 	EFI_SIGNATURE_LIST* efi_sig_list;
 	BYTE* dbx_data = NULL;
-	BOOL ret = FALSE, needs_free = FALSE;
+	BOOL needs_free = FALSE;
 	DWORD dbx_size = 0;
 	char dbx_name[32], path[MAX_PATH];
 	uint32_t i, fluff_size, nb_entries;
 
-	i = MachineToArch(GetPeArch(buf));
-	if (i == ARCH_UNKNOWN)
-		goto out;
+	safe_free(dbx_db[arch].hash);
+	dbx_db[arch].count = 0;
+	dbx_db[arch].timestamp = timestamp;
+	dbx_db[arch].compiled = TRUE;
 
 	// Check if a more recent local DBX should be preferred over embedded
-	static_sprintf(dbx_name, "dbx_%s.bin", efi_archname[i]);
-	if (UseLocalDbx(i)) {
+	static_sprintf(dbx_name, "dbx_%s.bin", efi_archname[arch]);
+	if (UseLocalDbx(arch)) {
 		static_sprintf(path, "%s\\%s\\%s", app_data_dir, FILES_DIR, dbx_name);
 		dbx_size = read_file(path, &dbx_data);
 		needs_free = (dbx_data != NULL);
@@ -2250,7 +2278,7 @@ static BOOL IsRevokedByDbx(uint8_t* hash, uint8_t* buf, uint32_t len)
 			duprintf("  Using local %s for revocation check", path);
 	}
 	if (dbx_size == 0) {
-		dbx_data = (BYTE*)GetResource(hMainInstance, MAKEINTRESOURCEA(IDR_DBX + i),
+		dbx_data = (BYTE*)GetResource(hMainInstance, MAKEINTRESOURCEA(IDR_DBX + arch),
 			_RT_RCDATA, dbx_name, &dbx_size, FALSE);
 	}
 	if (dbx_data == NULL || dbx_size <= sizeof(EFI_VARIABLE_AUTHENTICATION_2))
@@ -2273,17 +2301,42 @@ static BOOL IsRevokedByDbx(uint8_t* hash, uint8_t* buf, uint32_t len)
 	assert(efi_sig_list->SignatureSize != 0);
 	nb_entries = (efi_sig_list->SignatureListSize - efi_sig_list->SignatureHeaderSize - sizeof(EFI_SIGNATURE_LIST)) / efi_sig_list->SignatureSize;
 	assert(dbx_size >= fluff_size + nb_entries * efi_sig_list->SignatureSize);
+	if (dbx_size < fluff_size + nb_entries * efi_sig_list->SignatureSize)
+		goto out;
 
+	dbx_db[arch].hash = malloc((size_t)nb_entries * SHA256_HASHSIZE);
+	if (dbx_db[arch].hash == NULL)
+		goto out;
 	fluff_size += sizeof(GUID);
-	for (i = 0; i < nb_entries && !ret; i++) {
-		if (memcmp(hash, &dbx_data[fluff_size + i * efi_sig_list->SignatureSize], SHA256_HASHSIZE) == 0)
-			ret = TRUE;
-	}
+	for (i = 0; i < nb_entries; i++)
+		memcpy(&dbx_db[arch].hash[i * SHA256_HASHSIZE], &dbx_data[fluff_size + i * efi_sig_list->SignatureSize], SHA256_HASHSIZE);
+	qsort(dbx_db[arch].hash, nb_entries, SHA256_HASHSIZE, cmp_sha256);
+	dbx_db[arch].count = nb_entries;
+	duprintf("  Compiled %d DBX entries for %s", nb_entries, efi_archname[arch]);
 
 out:
 	if (needs_free)
 		free(dbx_data);
-	return ret;
+	return (dbx_db[arch].count != 0);
+}
+
+static BOOL IsRevokedByDbx(uint8_t* hash, uint8_t* buf, uint32_t len)
+{
+	char reg_name[32];
+	uint64_t timestamp;
+	int arch;
+
+	arch = MachineToArch(GetPeArch(buf));
+	if (arch == ARCH_UNKNOWN)
+		return FALSE;
+
+	// Only (re)compile the DBX if we never did or if a newer one was downloaded since
+	static_sprintf(reg_name, "DBXTimestamp_%s", efi_archname[arch]);
+	timestamp = (uint64_t)ReadSetting64(reg_name);
+	if ((!dbx_db[arch].compiled || timestamp != dbx_db[arch].timestamp) && !CompileDbx(arch, timestamp))
+		return FALSE;
+
+	return (bsearch(hash, dbx_db[arch].hash, dbx_db[arch].count, SHA256_HASHSIZE, cmp_sha256) != NULL);
 }
 
 static BOOL IsRevokedBySvn(uint8_t* buf, uint32_t len)
@@ -2364,20 +2417,9 @@ static BOOL IsRevokedByCert(cert_info_t* info)
 	return FALSE;
 }
 
-BOOL IsSignedBySecureBootAuthority(uint8_t* buf, uint32_t len)
+static BOOL IsSecureBootAuthority(cert_info_t* info)
 {
 	uint32_t i;
-	uint8_t* cert;
-	cert_info_t info;
-
-	if (buf == NULL || len < 0x100)
-		return FALSE;
-
-	// Get the signer/issuer info
-	cert = GetPeSignatureData(buf);
-	// Secure Boot Authority is always an issuer
-	if (GetIssuerCertificateInfo(cert, &info) != 2)
-		return FALSE;
 
 	// Fall back to embedded Secure Boot thumbprints if we couldn't access remote
 	if (sb_active_certs == NULL) {
@@ -2390,65 +2432,91 @@ BOOL IsSignedBySecureBootAuthority(uint8_t* buf, uint32_t len)
 		return FALSE;
 
 	for (i = 0; i < sb_active_certs->count; i++) {
-		if (memcmp(info.thumbprint, sb_active_certs->list[i], SHA1_HASHSIZE) == 0)
+		if (memcmp(info->thumbprint, sb_active_certs->list[i], SHA1_HASHSIZE) == 0)
 			return TRUE;
 	}
 	return FALSE;
 }
 
-int IsBootloaderRevoked(uint8_t* buf, uint32_t len)
+/*
+ * Parse the PE of the bootloaders from a batch, get their signer/issuer info and compute
+ * their PE256 hash. This is the expensive part of the checks, that can run on any thread.
+ */
+typedef struct {
+	bootloader_check_t* bl;
+	uint32_t count;
+	volatile LONG next;
+} bootloader_batch_t;
+
+static DWORD WINAPI BootloaderHashThread(LPVOID param)
 {
-	uint32_t i;
-	uint8_t hash[SHA256_HASHSIZE];
-	IMAGE_DOS_HEADER* dos_header = (IMAGE_DOS_HEADER*)buf;
+	bootloader_batch_t* batch = (bootloader_batch_t*)param;
+	bootloader_check_t* bl;
+	IMAGE_DOS_HEADER* dos_header;
 	IMAGE_NT_HEADERS32* pe_header;
-	uint8_t* cert;
-	cert_info_t info;
-	int r, revoked = 0;
-
-	if (buf == NULL || len < 0x100 || dos_header->e_magic != IMAGE_DOS_SIGNATURE)
-		return -2;
-	pe_header = (IMAGE_NT_HEADERS32*)&buf[dos_header->e_lfanew];
-	if (pe_header->Signature != IMAGE_NT_SIGNATURE)
-		return -2;
-
-	// Get the signer/issuer info
-	cert = GetPeSignatureData(buf);
-	r = GetIssuerCertificateInfo(cert, &info);
-	if (r == 0) {
-		uprintf("  (Unsigned Bootloader)");
-	} else if (r > 0) {
-		uprintf("  Signed by '%s'", info.name);
+	LONG i;
+
+	while ((i = InterlockedIncrement(&batch->next)) < (LONG)batch->count) {
+		bl = &batch->bl[i];
+		dos_header = (IMAGE_DOS_HEADER*)bl->buf;
+		bl->revoked = -2;
+		if (bl->buf == NULL || bl->len < 0x100 || dos_header->e_magic != IMAGE_DOS_SIGNATURE)
+			continue;
+		pe_header = (IMAGE_NT_HEADERS32*)&bl->buf[dos_header->e_lfanew];
+		if (pe_header->Signature != IMAGE_NT_SIGNATURE)
+			continue;
+		bl->revoked = 0;
+		// Errors are recorded, to be logged in order along with the bootloader they apply to
+		bl->cert_status = GetIssuerCertificateInfo(GetPeSignatureData(bl->buf), &bl->cert,
+			&bl->cert_error, &bl->cert_error_code);
 		// Only perform revocation checks on signed bootloaders
-		if (!PE256Buffer(buf, len, hash))
+		if (bl->cert_status > 0)
+			bl->hashed = PE256Buffer(bl->buf, bl->len, bl->hash);
+	}
+	return 0;
+}
+
+static int IsBootloaderRevoked(bootloader_check_t* bl)
+{
+	uint32_t i;
+	int revoked = 0;
+
+	if (bl->revoked < 0)
+		return bl->revoked;
+
+	if (bl->cert_status == 0) {
+		uprintf("  (Unsigned Bootloader)");
+	} else if (bl->cert_status > 0) {
+		uprintf("  Signed by '%s'", bl->cert.name);
+		if (!bl->hashed)
 			return -1;
 		// Check for UEFI DBX revocation
-		if (IsRevokedByDbx(hash, buf, len))
+		if (IsRevokedByDbx(bl->hash, bl->buf, bl->len))
 			revoked = 1;
 		// Check for Microsoft SSP revocation
 		for (i = 0; revoked == 0 && i < pe256ssp_size * SHA256_HASHSIZE; i += SHA256_HASHSIZE)
-			if (memcmp(hash, &pe256ssp[i], SHA256_HASHSIZE) == 0)
+			if (memcmp(bl->hash, &pe256ssp[i], SHA256_HASHSIZE) == 0)
 				revoked = 2;
 		// Check for Linux SBAT revocation
-		if (revoked == 0 && IsRevokedBySbat(buf, len))
+		if (revoked == 0 && IsRevokedBySbat(bl->buf, bl->len))
 			revoked = 3;
 		// Check for Microsoft SVN revocation
-		if (revoked == 0 && IsRevokedBySvn(buf, len))
+		if (revoked == 0 && IsRevokedBySvn(bl->buf, bl->len))
 			revoked = 4;
 		// Check for UEFI DBX certificate revocation
-		if (revoked == 0 && IsRevokedByCert(&info))
+		if (revoked == 0 && IsRevokedByCert(&bl->cert))
 			revoked = 5;
 
 		// If signed and not revoked, print the various Secure Boot "gotchas"
 		if (revoked == 0) {
-			if (strcmp(info.name, "Microsoft Windows Production PCA 2011") == 0) {
+			if (strcmp(bl->cert.name, "Microsoft Windows Production PCA 2011") == 0) {
 				uprintf("  Note: This bootloader may fail Secure Boot validation on systems that");
 				uprintf("  have been updated to use the 'Windows UEFI CA 2023' certificate.");
-			} else if (strcmp(info.name, "Windows UEFI CA 2023") == 0) {
+			} else if (strcmp(bl->cert.name, "Windows UEFI CA 2023") == 0) {
 				uprintf("  Note: This bootloader will fail Secure Boot validation on systems that");
 				uprintf("  have not been updated to use the latest Secure Boot certificates");
-			} else if (strcmp(info.name, "Microsoft Corporation UEFI CA 2011") == 0 ||
-				strcmp(info.name, "Microsoft UEFI CA 2023") == 0) {
+			} else if (strcmp(bl->cert.name, "Microsoft Corporation UEFI CA 2011") == 0 ||
+				strcmp(bl->cert.name, "Microsoft UEFI CA 2023") == 0) {
 				uprintf("  Note: This bootloader may fail Secure Boot validation on *some* systems,");
 				uprintf("  unless you enable \"Microsoft 3rd-party UEFI CA\" in your 'BIOS'.");
 			}
@@ -2458,6 +2526,96 @@ int IsBootloaderRevoked(uint8_t* buf, uint32_t len)
 	return revoked;
 }
 
+/*
+ * Check a batch of UEFI bootloaders for Secure Boot signature and revocation.
+ * The PE parsing and hashing is spread over worker threads, after which the
+ * revocation checks are carried out and reported in order.
+ */
+#define BOOTLOADER_CHECK_MAX_THREADS 8
+void CheckBootloaders(bootloader_check_t* bl, uint32_t count)
+{
+	bootloader_batch_t batch = { bl, count, -1 };
+	HANDLE hThread[BOOTLOADER_CHECK_MAX_THREADS];
+	SYSTEM_INFO si;
+	uint32_t i, num_threads;
+
+	if (bl == NULL || count == 0)
+		return;
+
+	// The calling thread also processes entries, so only create extra threads as needed
+	GetSystemInfo(&si);
+	num_threads = MIN(MIN(count, si.dwNumberOfProcessors), BOOTLOADER_CHECK_MAX_THREADS) - 1;
+	for (i = 0; i < num_threads; i++) {
+		hThread[i] = CreateThread(NULL, 0, BootloaderHashThread, &batch, 0, NULL);
+		if (hThread[i] == NULL)
+			break;
+	}
+	num_threads = i;
+	BootloaderHashThread(&batch);
+	if (num_threads != 0 && WaitForMultipleObjects(num_threads, hThread, TRUE, INFINITE) != WAIT_OBJECT_0)
+		uprintf("Failed to wait for bootloader hash threads: %s", WindowsErrorString());
+	for (i = 0; i < num_threads; i++)
+		safe_closehandle(hThread[i]);
+
+	for (i = 0; i < count; i++) {
+		bl[i].sb_signed = (bl[i].cert_status == 2) && IsSecureBootAuthority(&bl[i].cert);
+		uprintf("  • %s%s", bl[i].path, bl[i].sb_signed ? "*" : "");
+		if (bl[i].cert_error != NULL) {
+			if (bl[i].cert_error_code != 0) {
+				SetLastError(bl[i].cert_error_code);
+				uprintf("    PKI: %s: %s", bl[i].cert_error, WinPKIErrorString());
+			} else {
+				uprintf("    PKI: %s", bl[i].cert_error);
+			}
+		}
+		bl[i].revoked = IsBootloaderRevoked(&bl[i]);
+	}
+}
+
+/*
+ * Parse the content of an md5sum.txt into a hash table of the paths it lists (without
+ * any leading "./"), with the data of each entry set to the offset of its line + 1.
+ * md5_data must be NUL terminated. Returns the number of paths that were added.
+ */
+uint32_t ParseMD5Sum(char* md5_data, htab_table* htab)
+{
+	uint32_t i, n = 0, nb_lines = 1;
+	char *line, *path, *eol, c;
+
+	if (md5_data == NULL)
+		return 0;
+
+	for (line = md5_data; (line = strchr(line, '\n')) != NULL; line++)
+		nb_lines++;
+	// Keep the table sparse, since a lookup for an unlisted path only ends on an empty slot
+	if (!htab_create(2 * nb_lines, htab))
+		return 0;
+
+	for (line = md5_data; *line != 0; line = (*eol == 0) ? eol : &eol[1]) {
+		eol = &line[strcspn(line, "\r\n")];
+		// Lines are of the form "<hash>  ./path" or "<hash> *./path"
+		for (path = line; path < eol && IS_HEXASCII(*path); path++);
+		if (path - line != 2 * MD5_HASHSIZE || *path != ' ')
+			continue;
+		path++;
+		if (*path == ' ' || *path == '*')
+			path++;
+		if (path[0] == '.' && path[1] == '/')
+			path = &path[2];
+		if (path >= eol)
+			continue;
+		c = *eol;
+		*eol = 0;
+		i = htab_hash(path, htab);
+		*eol = c;
+		if (i != 0 && htab->table[i].data == NULL) {
+			htab->table[i].data = (void*)(uintptr_t)(line - md5_data + 1);
+			n++;
+		}
+	}
+	return n;
+}
+
 /*
  * Updates the MD5SUMS/md5sum.txt file that some distros (Ubuntu, Mint...)
  * use to validate the media. Because we may alter some of the validated files
@@ -2474,10 +2632,11 @@ void UpdateMD5Sum(const char* dest_dir, const char* md5sum_name)
 	DWORD res_size;
 	HANDLE hFile;
 	intptr_t pos;
-	uint32_t i, j, size, md5_size, new_size;
+	uint32_t i, j, k, size, md5_size, new_size;
 	uint8_t sum[MD5_HASHSIZE];
 	char md5_path[64], path1[64], path2[64], bootloader_name[32];
-	char *md5_data = NULL, *new_data = NULL, *str_pos, *d, *s, *p;
+	char *md5_data = NULL, *new_data = NULL, *d, *s, *p;
+	htab_table md5_htab = HTAB_EMPTY;
 
 	if (!img_report.has_md5sum && !validate_md5sum)
 		return;
@@ -2487,12 +2646,14 @@ void UpdateMD5Sum(const char* dest_dir, const char* md5sum_name)
 	if (md5_size == 0)
 		return;
 
+	if (modified_files.Index != 0)
+		ParseMD5Sum(md5_data, &md5_htab);
 	for (i = 0; i < modified_files.Index; i++) {
 		for (j = 0; j < (uint32_t)strlen(modified_files.String[i]); j++)
 			if (modified_files.String[i][j] == '\\')
 				modified_files.String[i][j] = '/';
-		str_pos = strstr(md5_data, &modified_files.String[i][2]);
-		if (str_pos == NULL)
+		k = htab_lookup(&modified_files.String[i][3], &md5_htab);
+		if (k == 0 || md5_htab.table[k].data == NULL)
 			// File is not listed in md5 sums
 			continue;
 		if (display_header) {
@@ -2500,16 +2661,15 @@ void UpdateMD5Sum(const char* dest_dir, const char* md5sum_name)
 			display_header = FALSE;
 		}
 		uprintf("● %s", &modified_files.String[i][2]);
-		pos = str_pos - md5_data;
+		pos = (intptr_t)md5_htab.table[k].data - 1;
 		HashFile(HASH_MD5, modified_files.String[i], sum);
-		while ((pos > 0) && (md5_data[pos - 1] != '\n'))
-			pos--;
 		assert(IS_HEXASCII(md5_data[pos]));
 		for (j = 0; j < 16; j++) {
 			md5_data[pos + 2 * j] = ((sum[j] >> 4) < 10) ? ('0' + (sum[j] >> 4)) : ('a' - 0xa + (sum[j] >> 4));
 			md5_data[pos + 2 * j + 1] = ((sum[j] & 15) < 10) ? ('0' + (sum[j] & 15)) : ('a' - 0xa + (sum[j] & 15));
 		}
 	}
+	htab_destroy(&md5_htab);
 
 	// If we validate md5sum we need to update the original bootloader names and add md5sum_totalbytes
 	if (validate_md5sum) {
@@ -2658,13 +2818,17 @@ const char* test_hash[HASH_MAX][4] = {
 	},
 };
 
+/* Size and number of passes of the buffer we use to measure the hash throughput */
+#define HASH_BENCHMARK_SIZE     (64 * MB)
+#define HASH_BENCHMARK_PASSES   2
+
 /* Tests the message digest algorithms */
 int TestHashes(void)
 {
 	const uint32_t blocksize[HASH_MAX] = { MD5_BLOCKSIZE, SHA1_BLOCKSIZE, SHA256_BLOCKSIZE, SHA512_BLOCKSIZE };
 	const char* hash_name[4] = { "MD5   ", "SHA1  ", "SHA256", "SHA512" };
 	int i, j, errors = 0;
-	uint8_t hash[MAX_HASHSIZE];
+	uint8_t hash[MAX_HASHSIZE], *buf;
 	size_t full_msg_len = strlen(test_msg);
 	char* msg = malloc(full_msg_len + 1);
 	if (msg == NULL)
@@ -2695,8 +2859,24 @@ int TestHashes(void)
 			}
 		}
 	}
-
 	free(msg);
+
+	/* Measure the throughput of each algorithm, so that regressions in the hash kernels get noticed */
+	buf = malloc(HASH_BENCHMARK_SIZE);
+	if (buf == NULL)
+		return errors;
+	for (i = 0; i < HASH_BENCHMARK_SIZE; i++)
+		buf[i] = (uint8_t)(i * 0x9E3779B1 >> 24);
+	for (j = 0; j < HASH_MAX; j++) {
+		uint64_t duration = GetTickCount64();
+		for (i = 0; i < HASH_BENCHMARK_PASSES; i++)
+			HashBuffer(j, buf, HASH_BENCHMARK_SIZE, hash);
+		duration = GetTickCount64() - duration;
+		uprintf("Speed %s: %s/s", hash_name[j], (duration == 0) ? "---" :
+			SizeToHumanReadable((uint64_t)HASH_BENCHMARK_SIZE * HASH_BENCHMARK_PASSES * 1000 / duration, FALSE, FALSE));
+	}
+	free(buf);
+
 	return errors;
 }
 #endif
@@ -66,6 +66,11 @@ _Static_assert(256 * KB >= ISO_BLOCKSIZE, "Can't set PROGRESS_THRESHOLD");
 #define ISO_EXTENSION_MASK        (ISO_EXTENSION_ALL & (enable_joliet ? ISO_EXTENSION_ALL : ~ISO_EXTENSION_JOLIET) & \
                                   (enable_rockridge ? ISO_EXTENSION_ALL : ~ISO_EXTENSION_ROCK_RIDGE))
 
+// Duplicated files smaller than this are just extracted again, and we limit how much
+// duplicated content we keep in memory for file systems that don't support hardlinks
+#define DEDUP_MIN_SIZE            (64 * KB)
+#define DEDUP_MAX_CACHE_SIZE      (64 * MB)
+
 // Is an MBR partition type for a FAT12/FAT16/FAT32 partition?
 #define IS_FAT_TYPE(x)            ((x) == 0x01 || (x) == 0x04 || (x) == 0x06 || (x) == 0x0b || (x) == 0x0c || (x) == 0x0e)
 
@@ -129,10 +134,25 @@ static const char* stupid_antivirus = "  NOTE: This is usually caused by a poorl
 const char* old_c32_name[NB_OLD_C32] = OLD_C32_NAMES;
 static const int64_t old_c32_threshold[NB_OLD_C32] = OLD_C32_THRESHOLD;
 static uint8_t joliet_level = 0;
-static uint32_t md5sum_size = 0;
 static BOOL scan_only = FALSE;
 static StrArray config_path, isolinux_path, grub_filesystems;
-static char symlinked_syslinux[MAX_PATH], *md5sum_data = NULL, *md5sum_pos = NULL;
+static char symlinked_syslinux[MAX_PATH];
+// Paths listed in the md5sum.txt from the image
+static htab_table md5sum_htab = HTAB_EMPTY;
+// Single extraction buffer, shared by all the recursion levels of the UDF/ISO9660 extractors
+static uint8_t* extract_buf = NULL;
+// ISO9660 extents (LSN + size) that are referenced by more than one path on the image
+typedef struct {
+	lsn_t lsn;
+	int64_t size;
+	uint32_t nb_refs;
+	uint32_t nb_left;	// Number of references still to be extracted
+	uint8_t* data;		// Cached content, to write the duplicates from
+} iso_extent_t;
+static iso_extent_t* iso_extent = NULL;
+static uint32_t nb_iso_extents = 0, max_iso_extents = 0;
+static int64_t dedup_cache_size;
+static uint64_t dedup_cached_bytes;
 
 // Ensure filenames do not contain invalid FAT32 or NTFS characters
 static __inline char* sanitize_filename(char* filename, BOOL* is_identical)
@@ -168,54 +188,21 @@ static void log_handler (cdio_log_level_t level, const char *message)
 // Returns TRUE if a path appears in md5sum.txt
 static BOOL is_in_md5sum(char* path)
 {
-	BOOL found = FALSE;
-	char c[3], * p, * pos = md5sum_pos, * nul_pos;
+	uint32_t i;
 
 	// If we are creating the md5sum file from scratch, every file is in it.
 	if (fd_md5sum != NULL)
 		return TRUE;
 
 	// If we don't have an existing file at this stage, then no file is in it.
-	if (md5sum_size == 0 || md5sum_data == NULL)
+	if (md5sum_htab.table == NULL)
 		return FALSE;
 
 	// We should have a "X:/xyz" path
 	assert(path[1] == ':' && path[2] == '/');
 
-	// Modify the path to have " ./xyz"
-	c[0] = path[0];
-	c[1] = path[1];
-	path[0] = ' ';
-	path[1] = '.';
-
-	// Search for the string in the remainder of the md5sum.txt
-	// NB: md5sum_data is always NUL terminated.
-	p = strstr(pos, path);
-	// Cater for the case where we matched a partial string and look for the full one
-	while (p != NULL && p[strlen(path)] != '\n' && p[strlen(path)] != '\r' && p[strlen(path)] != '\0') {
-		pos = p + strlen(path);
-		p = strstr(pos, path);
-	}
-	found = (p != NULL);
-	// If not found in remainder and we have a remainder, loop to search from beginning
-	if (!found && pos != md5sum_data) {
-		nul_pos = pos;
-		c[2] = *nul_pos;
-		*nul_pos = 0;
-		p = strstr(md5sum_data, path);
-		while (p != NULL && p[strlen(path)] != '\n' && p[strlen(path)] != '\r' && p[strlen(path)] != '\0') {
-			pos = p + strlen(path);
-			p = strstr(pos, path);
-		}
-		*nul_pos = c[2];
-		found = (p != NULL);
-	}
-
-	path[0] = c[0];
-	path[1] = c[1];
-	if (found)
-		md5sum_pos = p + strlen(path);
-	return found;
+	i = htab_lookup(&path[3], &md5sum_htab);
+	return (i != 0 && md5sum_htab.table[i].data != NULL);
 }
 
 static void _print_extracted_file(char* psz_fullpath, uint64_t file_length, BOOL split)
@@ -484,6 +471,7 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 	BOOL modified = FALSE, patched;
 	size_t nul_pos;
 	char *iso_label = NULL, *usb_label = NULL, *src, *dst;
+	config_doc* doc;
 
 	src = safe_strdup(psz_fullpath);
 	if (src == NULL)
@@ -491,22 +479,28 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 	nul_pos = strlen(src);
 	to_windows_path(src);
 
+	// Apply all the edits to an in-memory copy, so that we only read and write the file once.
+	// NB: The *_doc() calls are no-ops if the document could not be opened.
+	doc = open_config_doc(src);
+	if (doc == NULL)
+		uprintf("Could not open file '%s'", src);
+
 	// Add persistence to the kernel options
 	if ((boot_type == BT_IMAGE) && HAS_PERSISTENCE(img_report) && persistence_size) {
 		if ((props->is_grub_cfg) || (props->is_menu_cfg) || (props->is_syslinux_cfg)) {
-			if (replace_in_token_data(src, props->is_grub_cfg ? "linux" : "append",
-				"file=/cdrom/preseed", "persistent file=/cdrom/preseed", TRUE) != NULL) {
+			if (replace_in_token_data_doc(doc, props->is_grub_cfg ? "linux" : "append",
+				"file=/cdrom/preseed", "persistent file=/cdrom/preseed") != NULL) {
 				// Ubuntu & derivatives are assumed to use 'file=/cdrom/preseed/...'
 				// or 'layerfs-path=minimal.standard.live.squashfs' (see below)
 				// somewhere in their kernel options and use 'persistent' as keyword.
 				uprintf("  Added 'persistent' kernel option");
 				modified = TRUE;
 				// Also remove Ubuntu's "maybe-ubiquity" to avoid splash screen (GRUB only)
-				if ((props->is_grub_cfg) && replace_in_token_data(src, "linux",
-					"maybe-ubiquity", "", TRUE))
+				if ((props->is_grub_cfg) && replace_in_token_data_doc(doc, "linux",
+					"maybe-ubiquity", ""))
 					uprintf("  Removed 'maybe-ubiquity' kernel option");
-			} else if (replace_in_token_data(src, props->is_grub_cfg ? "linux" : "append",
-				"boot=casper", "boot=casper persistent", TRUE) != NULL) {
+			} else if (replace_in_token_data_doc(doc, props->is_grub_cfg ? "linux" : "append",
+				"boot=casper", "boot=casper persistent") != NULL) {
 				// Linux Mint uses "boot=casper". Oh and we want this replacement to happen BEFORE
 				// the "linux /casper/vmlinuz" one, because Mint (Why is it ALWAYS them?) also use
 				// "linux /casper/vmlinuz" and "kernel /casper/vmlinuz" in their config, and even
@@ -514,18 +508,18 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 				// make sure we don't have to do extra work to fix their inconsistency.
 				uprintf("  Added 'persistent' kernel option");
 				modified = TRUE;
-			} else if (replace_in_token_data(src, "linux", "/casper/vmlinuz",
-				"/casper/vmlinuz persistent", TRUE) != NULL) {
+			} else if (replace_in_token_data_doc(doc, "linux", "/casper/vmlinuz",
+				"/casper/vmlinuz persistent") != NULL) {
 				// Ubuntu 23.04 and 24.04 use GRUB only with the above and don't use "maybe-ubiquity"
 				uprintf("  Added 'persistent' kernel option");
 				modified = TRUE;
-			} else if (replace_in_token_data(src, "kernel", "/casper/vmlinuz",
-				"/casper/vmlinuz persistent", TRUE) != NULL) {
+			} else if (replace_in_token_data_doc(doc, "kernel", "/casper/vmlinuz",
+				"/casper/vmlinuz persistent") != NULL) {
 				// Some people might use "kernel" in their Syslinux config instead of "linux"
 				uprintf("  Added 'persistent' kernel option");
 				modified = TRUE;
-			} else if (replace_in_token_data(src, props->is_grub_cfg ? "linux" : "append",
-				"boot=live", "boot=live persistence", TRUE) != NULL) {
+			} else if (replace_in_token_data_doc(doc, props->is_grub_cfg ? "linux" : "append",
+				"boot=live", "boot=live persistence") != NULL) {
 				// Debian & derivatives are assumed to use 'boot=live' in
 				// their kernel options and use 'persistence' as keyword.
 				uprintf("  Added 'persistence' kernel option");
@@ -557,7 +551,7 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 		if ((iso_label != NULL) && (usb_label != NULL)) {
 			patched = FALSE;
 			for (int i = 0; i < ARRAYSIZE(cfg_token); i++) {
-				if (replace_in_token_data(src, cfg_token[i], iso_label, usb_label, TRUE) != NULL) {
+				if (replace_in_token_data_doc(doc, cfg_token[i], iso_label, usb_label) != NULL) {
 					modified = TRUE;
 					patched = TRUE;
 				}
@@ -574,7 +568,7 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 			patched = FALSE;
 			if (img_report.rh8_derivative && (strstr(image_path, "netinst") == NULL)) {
 				for (int i = 0; i < ARRAYSIZE(cfg_token); i++) {
-					if (replace_in_token_data(src, cfg_token[i], "inst.stage2", "inst.repo", TRUE) != NULL) {
+					if (replace_in_token_data_doc(doc, cfg_token[i], "inst.stage2", "inst.repo") != NULL) {
 						modified = TRUE;
 						patched = TRUE;
 					}
@@ -587,16 +581,6 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 		safe_free(usb_label);
 	}
 
-	// Fix dual BIOS + EFI support for tails and other ISOs
-	if ( (props->is_syslinux_cfg) && (safe_stricmp(psz_path, efi_dirname) == 0) &&
-		 (safe_stricmp(psz_basename, syslinux_cfg[0]) == 0) &&
-		 (!img_report.has_efi_syslinux) && (dst = safe_strdup(src)) ) {
-		dst[nul_pos-12] = 's'; dst[nul_pos-11] = 'y'; dst[nul_pos-10] = 's';
-		CopyFileA(src, dst, TRUE);
-		uprintf("Duplicated %s to %s", src, dst);
-		free(dst);
-	}
-
 	// Workaround for FreeNAS
 	if (props->is_grub_cfg) {
 		iso_label = malloc(MAX_PATH);
@@ -604,7 +588,7 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 		if ((iso_label != NULL) && (usb_label != NULL)) {
 			safe_sprintf(iso_label, MAX_PATH, "cd9660:/dev/iso9660/%s", img_report.label);
 			safe_sprintf(usb_label, MAX_PATH, "msdosfs:/dev/msdosfs/%s", img_report.usb_label);
-			if (replace_in_token_data(src, "set", iso_label, usb_label, TRUE) != NULL) {
+			if (replace_in_token_data_doc(doc, "set", iso_label, usb_label) != NULL) {
 				uprintf("  Patched %s: '%s' ➔ '%s'", src, iso_label, usb_label);
 				modified = TRUE;
 			}
@@ -613,6 +597,19 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 		safe_free(usb_label);
 	}
 
+	if ((doc != NULL) && (!close_config_doc(doc, TRUE)))
+		modified = FALSE;
+
+	// Fix dual BIOS + EFI support for tails and other ISOs
+	if ( (props->is_syslinux_cfg) && (safe_stricmp(psz_path, efi_dirname) == 0) &&
+		 (safe_stricmp(psz_basename, syslinux_cfg[0]) == 0) &&
+		 (!img_report.has_efi_syslinux) && (dst = safe_strdup(src)) ) {
+		dst[nul_pos-12] = 's'; dst[nul_pos-11] = 'y'; dst[nul_pos-10] = 's';
+		CopyFileA(src, dst, TRUE);
+		uprintf("Duplicated %s to %s", src, dst);
+		free(dst);
+	}
+
 	if (modified)
 		StrArrayAdd(&modified_files, psz_fullpath, TRUE);
 
@@ -659,13 +656,11 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 	udf_dirent_t *p_udf_dirent2;
 	_Static_assert(ISO_BUFFER_SIZE % UDF_BLOCKSIZE == 0,
 		"ISO_BUFFER_SIZE is not a multiple of UDF_BLOCKSIZE");
-	uint8_t* buf = malloc(ISO_BUFFER_SIZE);
+	uint8_t* buf = extract_buf;
 	int64_t read, file_length;
 
-	if ((p_udf_dirent == NULL) || (psz_path == NULL) || (buf == NULL)) {
-		safe_free(buf);
+	if ((p_udf_dirent == NULL) || (psz_path == NULL) || (buf == NULL))
 		return 1;
-	}
 
 	if (psz_path[0] == 0)
 		UpdateProgressWithInfoInit(NULL, TRUE);
@@ -784,7 +779,6 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 		}
 		safe_free(psz_fullpath);
 	}
-	safe_free(buf);
 	return 0;
 
 out:
@@ -794,10 +788,93 @@ out:
 	ISO_BLOCKING(safe_closehandle(file_handle));
 	safe_free(psz_sanpath);
 	safe_free(psz_fullpath);
-	safe_free(buf);
 	return 1;
 }
 
+// Record an extent during scan, so that we can find the ones that are shared by multiple files
+static void add_iso_extent(lsn_t lsn, int64_t size)
+{
+	iso_extent_t* new_extent;
+
+	if (size < DEDUP_MIN_SIZE)
+		return;
+	if (nb_iso_extents >= max_iso_extents) {
+		// Deduplication is only an optimization, so just stop recording if we run out of memory
+		new_extent = realloc(iso_extent, (max_iso_extents + 1024) * sizeof(iso_extent_t));
+		if (new_extent == NULL)
+			return;
+		iso_extent = new_extent;
+		max_iso_extents += 1024;
+	}
+	memset(&iso_extent[nb_iso_extents], 0, sizeof(iso_extent_t));
+	iso_extent[nb_iso_extents].lsn = lsn;
+	iso_extent[nb_iso_extents].size = size;
+	iso_extent[nb_iso_extents].nb_refs = 1;
+	nb_iso_extents++;
+}
+
+static int cmp_iso_extent(const void* a, const void* b)
+{
+	const iso_extent_t* ea = (const iso_extent_t*)a;
+	const iso_extent_t* eb = (const iso_extent_t*)b;
+
+	if (ea->lsn != eb->lsn)
+		return (ea->lsn < eb->lsn) ? -1 : 1;
+	if (ea->size != eb->size)
+		return (ea->size < eb->size) ? -1 : 1;
+	return 0;
+}
+
+// Sort the extents recorded during scan and only keep the ones that are referenced more than once
+static void compile_iso_extents(void)
+{
+	uint32_t i, j = 0;
+
+	if (nb_iso_extents == 0)
+		return;
+	qsort(iso_extent, nb_iso_extents, sizeof(iso_extent_t), cmp_iso_extent);
+	for (i = 1; i < nb_iso_extents; i++) {
+		if (cmp_iso_extent(&iso_extent[i], &iso_extent[j]) == 0)
+			iso_extent[j].nb_refs++;
+		else if (iso_extent[j].nb_refs > 1)
+			iso_extent[++j] = iso_extent[i];
+		else
+			iso_extent[j] = iso_extent[i];
+	}
+	nb_iso_extents = (iso_extent[j].nb_refs > 1) ? j + 1 : j;
+	if (nb_iso_extents != 0)
+		uprintf("  Found %d file extent(s) shared by multiple paths", nb_iso_extents);
+}
+
+static iso_extent_t* find_iso_extent(lsn_t lsn, int64_t size)
+{
+	iso_extent_t key = { 0 };
+
+	if (nb_iso_extents == 0)
+		return NULL;
+	key.lsn = lsn;
+	key.size = size;
+	return (iso_extent_t*)bsearch(&key, iso_extent, nb_iso_extents, sizeof(iso_extent_t), cmp_iso_extent);
+}
+
+// Release the extraction data of shared extents and, optionally, the extents themselves
+static void reset_iso_extents(BOOL free_extents)
+{
+	uint32_t i;
+
+	for (i = 0; i < nb_iso_extents; i++) {
+		safe_free(iso_extent[i].data);
+		iso_extent[i].nb_left = iso_extent[i].nb_refs;
+	}
+	dedup_cache_size = 0;
+	dedup_cached_bytes = 0;
+	if (free_extents) {
+		safe_free(iso_extent);
+		nb_iso_extents = 0;
+		max_iso_extents = 0;
+	}
+}
+
 // Returns 0 on success, >0 on error, <0 to ignore current dir
 static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 {
@@ -805,14 +882,16 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 	DWORD buf_size, wr_size, err;
 	EXTRACT_PROPS props;
 	HASH_CONTEXT ctx;
-	BOOL is_symlink, is_identical, create_file, free_p_statbuf = FALSE;
+	BOOL is_symlink, is_identical, create_file, fill_cache, free_p_statbuf = FALSE;
 	int length, r = 1;
 	char psz_fullpath[MAX_PATH], *psz_basename = NULL, *psz_sanpath = NULL;
 	char tmp[128], target_path[256], *last_slash;
 	const char *psz_iso_name = &psz_fullpath[strlen(psz_extract_dir)];
 	_Static_assert(ISO_BUFFER_SIZE % ISO_BLOCKSIZE == 0,
 		"ISO_BUFFER_SIZE is not a multiple of ISO_BLOCKSIZE");
-	uint8_t* buf = malloc(ISO_BUFFER_SIZE);
+	uint8_t* buf = extract_buf;
+	const uint8_t* src;
+	iso_extent_t* extent;
 	CdioListNode_t* p_entnode;
 	iso9660_stat_t *p_statbuf;
 	CdioISO9660FileList_t* p_entlist = NULL;
@@ -820,10 +899,8 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 	lsn_t lsn;
 	int64_t file_length;
 
-	if ((p_iso == NULL) || (psz_path == NULL) || (buf == NULL)) {
-		safe_free(buf);
+	if ((p_iso == NULL) || (psz_path == NULL) || (buf == NULL))
 		return 1;
-	}
 
 	length = _snprintf_s(psz_fullpath, sizeof(psz_fullpath), _TRUNCATE, "%s%s/", psz_extract_dir, psz_path);
 	if (length < 0)
@@ -896,6 +973,8 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 		} else {
 			file_length = p_statbuf->total_size;
 			if (check_iso_props(psz_path, file_length, psz_basename, psz_fullpath, &props)) {
+				if (scan_only && !is_symlink)
+					add_iso_extent(p_statbuf->lsn, file_length);
 				if (is_symlink && (file_length == 0)) {
 					// Add symlink duplicated files to total_size at scantime
 					if ((strcmp(psz_path, "/firmware") == 0)) {
@@ -903,6 +982,7 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 						iso9660_stat_t* p_statbuf2 = iso9660_ifs_stat_translate(p_iso, target_path);
 						if (p_statbuf2 != NULL) {
 							extra_blocks += (p_statbuf2->total_size + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE;
+							add_iso_extent(p_statbuf2->lsn, p_statbuf2->total_size);
 							iso9660_stat_free(p_statbuf2);
 						}
 					} else if ((strcmp(p_statbuf->filename, "live") == 0) &&
@@ -965,6 +1045,8 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 							// The original p_statbuf will be freed automatically, but not
 							// the new one so we need to force an explicit free.
 							free_p_statbuf = TRUE;
+							// From here on, this is a regular copy of the target's data
+							is_symlink = FALSE;
 							file_length = p_statbuf->total_size;
 							print_extracted_file(psz_fullpath, file_length);
 							uprintf("  Duplicated from '%s'", target_path);
@@ -981,6 +1063,12 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 					create_file = FALSE;
 				}
 			}
+			// Content that is shared with a file we already extracted can be written from memory.
+			// NB: We don't hardlink these on NTFS, since some of the duplicates (bootloaders,
+			// fonts...) may be overwritten after extraction, which must not alter their twins.
+			extent = NULL;
+			if (create_file && !is_symlink && !props.is_cfg && !props.is_conf)
+				extent = find_iso_extent(p_statbuf->lsn, file_length);
 			if (create_file) {
 				file_handle = CreatePreallocatedFile(psz_sanpath, GENERIC_READ | GENERIC_WRITE,
 					FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, file_length);
@@ -1018,20 +1106,39 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 				} else {
 					if (fd_md5sum != NULL)
 						hash_init[HASH_MD5](&ctx);
+					// Keep the content of shared extents in memory, so that the duplicates
+					// don't have to be read again.
+					fill_cache = FALSE;
+					if (extent != NULL && extent->data == NULL && extent->nb_left > 1 &&
+						dedup_cache_size + file_length <= DEDUP_MAX_CACHE_SIZE) {
+						extent->data = malloc((size_t)file_length);
+						fill_cache = (extent->data != NULL);
+						if (fill_cache)
+							dedup_cache_size += file_length;
+					} else if (extent != NULL && extent->data != NULL) {
+						dedup_cached_bytes += file_length;
+					}
 					for (i = 0; file_length > 0; i += nb) {
 						if (ErrorStatus)
 							goto out;
 						lsn = p_statbuf->lsn + (lsn_t)i;
 						nb = (size_t)MIN(ISO_BUFFER_SIZE / ISO_BLOCKSIZE, (file_length + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE);
-						if (iso9660_iso_seek_read(p_iso, buf, lsn, (long)nb) != (nb * ISO_BLOCKSIZE)) {
-							uprintf("  Error reading ISO9660 file %s at LSN %lu",
-								psz_iso_name, (long unsigned int)lsn);
-							goto out;
-						}
 						buf_size = (DWORD)MIN(file_length, ISO_BUFFER_SIZE);
+						if (extent != NULL && extent->data != NULL && !fill_cache) {
+							src = &extent->data[i * ISO_BLOCKSIZE];
+						} else {
+							if (iso9660_iso_seek_read(p_iso, buf, lsn, (long)nb) != (nb * ISO_BLOCKSIZE)) {
+								uprintf("  Error reading ISO9660 file %s at LSN %lu",
+									psz_iso_name, (long unsigned int)lsn);
+								goto out;
+							}
+							if (fill_cache)
+								memcpy(&extent->data[i * ISO_BLOCKSIZE], buf, buf_size);
+							src = buf;
+						}
 						if (fd_md5sum != NULL)
-							hash_write[HASH_MD5](&ctx, buf, buf_size);
-						ISO_BLOCKING(r = WriteFileWithRetry(file_handle, buf, buf_size, &wr_size, WRITE_RETRIES));
+							hash_write[HASH_MD5](&ctx, src, buf_size);
+						ISO_BLOCKING(r = WriteFileWithRetry(file_handle, src, buf_size, &wr_size, WRITE_RETRIES));
 						if (!r || wr_size != buf_size) {
 							if (r)
 								SetLastError(ERROR_WRITE_FAULT);
@@ -1059,6 +1166,10 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 						uprintf("  Could not set timestamp: %s", WindowsErrorString());
 				}
 			}
+			if ((extent != NULL) && (extent->nb_left > 0) && (--extent->nb_left == 0) && (extent->data != NULL)) {
+				dedup_cache_size -= extent->size;
+				safe_free(extent->data);
+			}
 			if (free_p_statbuf)
 				iso9660_stat_free(p_statbuf);
 			ISO_BLOCKING(safe_closehandle(file_handle));
@@ -1076,7 +1187,6 @@ out:
 	if (p_entlist != NULL)
 		iso9660_filelist_free(p_entlist);
 	safe_free(psz_sanpath);
-	safe_free(buf);
 	return r;
 }
 
@@ -1223,7 +1333,7 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 {
 	const char* basedir[] = { "i386", "amd64", "minint" };
 	int k, r = 1;
-	char *tmp, *ext, *spacing = "  ";
+	char *tmp, *ext, *md5sum_data, *spacing = "  ";
 	char path[MAX_PATH], path2[16];
 	uint8_t* buf = NULL;
 	uint16_t sl_version;
@@ -1254,6 +1364,7 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 		StrArrayCreate(&config_path, 8);
 		StrArrayCreate(&isolinux_path, 8);
 		StrArrayCreate(&grub_filesystems, 8);
+		reset_iso_extents(TRUE);
 		PrintInfo(0, MSG_202);
 	} else {
 		uprintf("Extracting files...");
@@ -1268,6 +1379,7 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 		iso_blocking_status = 0;
 		symlinked_syslinux[0] = 0;
 		StrArrayClear(&modified_files);
+		reset_iso_extents(FALSE);
 		if (validate_md5sum) {
 			md5sum_totalbytes = 0;
 			// If there isn't an already existing md5sum.txt create one
@@ -1276,13 +1388,21 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 				fd_md5sum = fopenU(path, "wb");
 				if (fd_md5sum == NULL)
 					uprintf("WARNING: Could not create '%s'", md5sum_name[0]);
-			} else {
-				md5sum_size = ReadISOFileToBuffer(src_iso, md5sum_name[0], (uint8_t**)&md5sum_data);
-				md5sum_pos = md5sum_data;
+			} else if (ReadISOFileToBuffer(src_iso, md5sum_name[0], (uint8_t**)&md5sum_data) != 0) {
+				ParseMD5Sum(md5sum_data, &md5sum_htab);
+				free(md5sum_data);
 			}
 		}
 	}
 
+	// Allocated once for the whole extraction, rather than once per directory level
+	extract_buf = malloc(ISO_BUFFER_SIZE);
+	if (extract_buf == NULL) {
+		uprintf("Could not allocate ISO extraction buffer");
+		ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
+		goto out;
+	}
+
 	// First try to open as UDF - fallback to ISO if it failed
 	p_udf = udf_open(src_iso);
 	if (p_udf == NULL)
@@ -1340,10 +1460,12 @@ try_iso:
 
 out:
 	iso_blocking_status = -1;
+	safe_free(extract_buf);
 	if (scan_only) {
 		const char* fs_name[] = { "fat", "exfat", "ntfs" };
 		struct __stat64 stat;
 		char fses[256] = { 0 };
+		compile_iso_extents();
 		// Find if there is a mismatch between the ISO size, as reported by the PVD, and the actual file size
 		if ((iso9660_ifs_read_pvd(p_iso, &pvd)) && (_stat64U(src_iso, &stat) == 0))
 			img_report.mismatch_size = (int64_t)(iso9660_get_pvd_space_size(&pvd)) * ISO_BLOCKSIZE - stat.st_size;
@@ -1603,10 +1725,13 @@ out:
 		if (fd_md5sum != NULL) {
 			uprintf("Created: %s\\%s (%s)", dest_dir, md5sum_name[0], SizeToHumanReadable(ftell(fd_md5sum), FALSE, FALSE));
 			fclose(fd_md5sum);
-		} else if (md5sum_data != NULL) {
-			safe_free(md5sum_data);
-			md5sum_size = 0;
+			fd_md5sum = NULL;
 		}
+		htab_destroy(&md5sum_htab);
+		if (dedup_cached_bytes != 0)
+			uprintf("Copied %s of duplicated content from memory, instead of reading it from the image",
+				SizeToHumanReadable(dedup_cached_bytes, FALSE, FALSE));
+		reset_iso_extents(FALSE);
 	}
 	iso9660_close(p_iso);
 	udf_close(p_udf);
@@ -1714,19 +1839,25 @@ out:
 }
 
 /*
- * Extract a file to a buffer. Buffer must be freed by the caller.
+ * Extract multiple files to buffers, while only opening the image once. For ISO-9660,
+ * the files are also read in the order in which they are laid out on the image.
+ * Buffers must be freed by the caller. Returns the number of files that were read.
  */
-uint32_t ReadISOFileToBuffer(const char* iso, const char* iso_file, uint8_t** buf)
+uint32_t ReadISOFilesToBuffers(const char* iso, uint32_t count, const char** iso_file, uint8_t** buf, uint32_t* len)
 {
 	ssize_t read_size;
 	int64_t file_length;
-	uint32_t ret = 0, nblocks;
+	uint32_t i, j, k, ret = 0, nblocks;
+	uint32_t* order = NULL;
 	iso9660_t* p_iso = NULL;
 	udf_t* p_udf = NULL;
 	udf_dirent_t *p_udf_root = NULL, *p_udf_file = NULL;
-	iso9660_stat_t* p_statbuf = NULL;
+	iso9660_stat_t** p_statbuf = NULL;
 
-	*buf = NULL;
+	for (i = 0; i < count; i++) {
+		buf[i] = NULL;
+		len[i] = 0;
+	}
 	cdio_loglevel_default = CDIO_LOG_WARN;
 
 	// First try to open as UDF - fallback to ISO if it failed
@@ -1738,29 +1869,32 @@ uint32_t ReadISOFileToBuffer(const char* iso, const char* iso_file, uint8_t** bu
 		uprintf("Could not locate UDF root directory");
 		goto out;
 	}
-	p_udf_file = udf_fopen(p_udf_root, iso_file);
-	if (!p_udf_file) {
-		uprintf("Could not locate file %s in ISO image", iso_file);
-		goto out;
-	}
-	file_length = udf_get_file_length(p_udf_file);
-	if (file_length > 1 * GB) {
-		uprintf("Only files smaller than 1 GB are supported");
-		goto out;
-	}
-	nblocks = (uint32_t)((file_length + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE);
-	*buf = malloc(nblocks * UDF_BLOCKSIZE + 1);
-	if (*buf == NULL) {
-		uprintf("Could not allocate buffer for file %s", iso_file);
-		goto out;
-	}
-	read_size = udf_read_block(p_udf_file, *buf, nblocks);
-	if (read_size < 0 || read_size != file_length) {
-		uprintf("Error reading UDF file %s", iso_file);
-		goto out;
+	for (i = 0; i < count; i++) {
+		// NB: udf_fopen() resets the read position, so each file must be read before the next is opened
+		p_udf_file = udf_fopen(p_udf_root, iso_file[i]);
+		if (!p_udf_file) {
+			uprintf("Could not locate file %s in ISO image", iso_file[i]);
+			continue;
+		}
+		file_length = udf_get_file_length(p_udf_file);
+		if (file_length > 1 * GB) {
+			uprintf("Only files smaller than 1 GB are supported");
+		} else {
+			nblocks = (uint32_t)((file_length + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE);
+			buf[i] = malloc(nblocks * UDF_BLOCKSIZE + 1);
+			if (buf[i] == NULL) {
+				uprintf("Could not allocate buffer for file %s", iso_file[i]);
+			} else {
+				read_size = udf_read_block(p_udf_file, buf[i], nblocks);
+				if (read_size < 0 || read_size != file_length)
+					uprintf("Error reading UDF file %s", iso_file[i]);
+				else
+					len[i] = (uint32_t)file_length;
+			}
+		}
+		udf_dirent_free(p_udf_file);
+		p_udf_file = NULL;
 	}
-	ret = (uint32_t)file_length;
-	(*buf)[ret] = 0;
 	goto out;
 
 try_iso:
@@ -1771,42 +1905,73 @@ try_iso:
 		uprintf("Unable to open image '%s'", iso);
 		goto out;
 	}
-	p_statbuf = iso9660_ifs_stat_translate(p_iso, iso_file);
-	if (p_statbuf == NULL) {
-		uprintf("Could not get ISO-9660 file information for file %s", iso_file);
-		goto out;
-	}
-	file_length = p_statbuf->total_size;
-	if (file_length > 1 * GB) {
-		uprintf("Only files smaller than 1 GB are supported");
-		goto out;
-	}
-	// coverity[cast_overflow]
-	nblocks = (uint32_t)((file_length + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE);
-	*buf = malloc(nblocks * ISO_BLOCKSIZE + 1);
-	if (*buf == NULL) {
-		uprintf("Could not allocate buffer for file %s", iso_file);
-		goto out;
-	}
-	if (iso9660_iso_seek_read(p_iso, *buf, p_statbuf->lsn, nblocks) != nblocks * ISO_BLOCKSIZE) {
-		uprintf("Error reading ISO file %s", iso_file);
+	p_statbuf = calloc(count, sizeof(iso9660_stat_t*));
+	order = calloc(count, sizeof(uint32_t));
+	if (p_statbuf == NULL || order == NULL)
 		goto out;
+	// Locate all the files first, and sort them by LSN so that the image is read sequentially
+	for (i = 0, k = 0; i < count; i++) {
+		p_statbuf[i] = iso9660_ifs_stat_translate(p_iso, iso_file[i]);
+		if (p_statbuf[i] == NULL) {
+			uprintf("Could not get ISO-9660 file information for file %s", iso_file[i]);
+			continue;
+		}
+		for (j = k++; j > 0 && p_statbuf[order[j - 1]]->lsn > p_statbuf[i]->lsn; j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+	for (j = 0; j < k; j++) {
+		i = order[j];
+		file_length = p_statbuf[i]->total_size;
+		if (file_length > 1 * GB) {
+			uprintf("Only files smaller than 1 GB are supported");
+			continue;
+		}
+		// coverity[cast_overflow]
+		nblocks = (uint32_t)((file_length + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE);
+		buf[i] = malloc(nblocks * ISO_BLOCKSIZE + 1);
+		if (buf[i] == NULL) {
+			uprintf("Could not allocate buffer for file %s", iso_file[i]);
+			continue;
+		}
+		if (iso9660_iso_seek_read(p_iso, buf[i], p_statbuf[i]->lsn, nblocks) != nblocks * ISO_BLOCKSIZE) {
+			uprintf("Error reading ISO file %s", iso_file[i]);
+			continue;
+		}
+		len[i] = (uint32_t)file_length;
 	}
-	ret = (uint32_t)file_length;
-	(*buf)[ret] = 0;
 
 out:
-	iso9660_stat_free(p_statbuf);
+	for (i = 0; i < count; i++) {
+		if (p_statbuf != NULL)
+			iso9660_stat_free(p_statbuf[i]);
+		if (len[i] == 0) {
+			safe_free(buf[i]);
+		} else {
+			buf[i][len[i]] = 0;
+			ret++;
+		}
+	}
+	free(p_statbuf);
+	free(order);
 	udf_dirent_free(p_udf_root);
-	udf_dirent_free(p_udf_file);
 	iso9660_close(p_iso);
 	udf_close(p_udf);
 	cdio_loglevel_default = usb_debug ? CDIO_LOG_INFO : CDIO_LOG_WARN;
-	if (ret == 0)
-		safe_free(*buf);
 	return ret;
 }
 
+/*
+ * Extract a file to a buffer. Buffer must be freed by the caller.
+ */
+uint32_t ReadISOFileToBuffer(const char* iso, const char* iso_file, uint8_t** buf)
+{
+	uint32_t len;
+
+	ReadISOFilesToBuffers(iso, 1, &iso_file, buf, &len);
+	return len;
+}
+
 #define ISO_NB_BLOCKS 16
 typedef struct {
 	iso9660_t*      p_iso;
@@ -1820,28 +1985,31 @@ typedef struct {
  * Read sectors from a FAT img file residing on an ISO-9660 filesystem.
  * NB: This assumes that the img file sectors are contiguous on the ISO.
   */
-int iso9660_readfat(intptr_t pp, void *buf, size_t secsize, libfat_sector_t sec)
+int iso9660_readfat(intptr_t pp, void *buf, size_t size, libfat_sector_t sec)
 {
 	iso9660_readfat_private* p_private = (iso9660_readfat_private*)pp;
+	size_t i, secsize = LIBFAT_SECTOR_SIZE;
 
 	if (sizeof(p_private->buf) % secsize != 0) {
 		uprintf("iso9660_readfat: Sector size %zu is not a divisor of %zu", secsize, sizeof(p_private->buf));
 		return 0;
 	}
 
-	if ((sec < p_private->sec_start) || (sec >= p_private->sec_start + sizeof(p_private->buf) / secsize)) {
-		// Sector being queried is not in our multi block buffer -> Update it
-		p_private->sec_start = (((sec * secsize) / ISO_BLOCKSIZE) * ISO_BLOCKSIZE) / secsize;
-		if (iso9660_iso_seek_read(p_private->p_iso, p_private->buf,
-			p_private->lsn + (lsn_t)((p_private->sec_start * secsize) / ISO_BLOCKSIZE), ISO_NB_BLOCKS)
-			!= ISO_NB_BLOCKS * ISO_BLOCKSIZE) {
-			uprintf("Error reading ISO-9660 file %s at LSN %lu", img_report.efi_img_path,
-				(long unsigned int)(p_private->lsn + (p_private->sec_start * secsize) / ISO_BLOCKSIZE));
-			return 0;
+	for (i = 0; i < size / secsize; i++, sec++) {
+		if ((sec < p_private->sec_start) || (sec >= p_private->sec_start + sizeof(p_private->buf) / secsize)) {
+			// Sector being queried is not in our multi block buffer -> Update it
+			p_private->sec_start = (((sec * secsize) / ISO_BLOCKSIZE) * ISO_BLOCKSIZE) / secsize;
+			if (iso9660_iso_seek_read(p_private->p_iso, p_private->buf,
+				p_private->lsn + (lsn_t)((p_private->sec_start * secsize) / ISO_BLOCKSIZE), ISO_NB_BLOCKS)
+				!= ISO_NB_BLOCKS * ISO_BLOCKSIZE) {
+				uprintf("Error reading ISO-9660 file %s at LSN %lu", img_report.efi_img_path,
+					(long unsigned int)(p_private->lsn + (p_private->sec_start * secsize) / ISO_BLOCKSIZE));
+				return 0;
+			}
 		}
+		memcpy(&((uint8_t*)buf)[i * secsize], &p_private->buf[(sec - p_private->sec_start) * secsize], secsize);
 	}
-	memcpy(buf, &p_private->buf[(sec - p_private->sec_start)*secsize], secsize);
-	return (int)secsize;
+	return (int)size;
 }
 
 /*
@@ -2036,8 +2204,6 @@ BOOL DumpFatDir(void* iso, const char* path, int32_t cluster)
 					}
 					written += size;
 					s = libfat_nextsector(lf_fs, s);
-					// Trust me, you *REALLY* want to invoke libfat_flush() here
-					libfat_flush(lf_fs);
 				}
 				safe_closehandle(handle);
 				if (props.is_conf)
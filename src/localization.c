@@ -194,6 +194,7 @@ void _exit_localization(BOOL reinit) {
 		return;
 	if (!reinit) {
 		free_locale_list();
+		close_loc_file();
 		if (loc_filename != embedded_loc_filename)
 			safe_free(loc_filename);
 	}
@@ -1364,6 +1364,16 @@ static __inline BOOL CreateSymbolicLinkU(const char* lpSymlinkFileName, const ch
 	return ret;
 }
 
+static __inline BOOL CreateHardLinkU(const char* lpFileName, const char* lpExistingFileName, LPSECURITY_ATTRIBUTES lpSecurityAttributes)
+{
+	wconvert(lpFileName);
+	wconvert(lpExistingFileName);
+	BOOL ret = CreateHardLinkW(wlpFileName, wlpExistingFileName, lpSecurityAttributes);
+	wfree(lpExistingFileName);
+	wfree(lpFileName);
+	return ret;
+}
+
 // The following expects PropertyBuffer to contain a single Unicode string
 static __inline BOOL SetupDiGetDeviceRegistryPropertyU(HDEVINFO DeviceInfoSet, PSP_DEVINFO_DATA DeviceInfoData,
 	DWORD Property, PDWORD PropertyRegDataType, PBYTE PropertyBuffer, DWORD PropertyBufferSize, PDWORD RequiredSize)
@@ -199,14 +199,59 @@ static void get_loc_data_line(char* line)
 		free_loc_cmd(lcmd);
 }
 
+/*
+ * In-memory copy of the localization file. The file is read once and then reused
+ * for the enumeration of locales, as well as for any locale being selected, since
+ * character by character parsing through stdio is way too slow for a 1.4 MB file.
+ */
+typedef struct {
+	char* path;
+	char* data;
+	long size;
+	long pos;
+} loc_file;
+
+static loc_file loc_fd = { NULL, NULL, 0, 0 };
+
+static __inline int loc_getc(loc_file* fd)
+{
+	return (fd->pos < fd->size) ? (uint8_t)fd->data[fd->pos++] : EOF;
+}
+
+static char* loc_gets(char* line, int size, loc_file* fd)
+{
+	int i;
+
+	if (fd->pos >= fd->size)
+		return NULL;
+	for (i = 0; (i < size - 1) && (fd->pos < fd->size); ) {
+		line[i++] = fd->data[fd->pos++];
+		if (line[i - 1] == '\n')
+			break;
+	}
+	line[i] = 0;
+	return line;
+}
+
+/*
+ * Release the in-memory copy of the localization file
+ */
+void close_loc_file(void)
+{
+	safe_free(loc_fd.path);
+	safe_free(loc_fd.data);
+	loc_fd.size = 0;
+	loc_fd.pos = 0;
+}
+
 /*
  * Open a localization file and store its file name, with special case
  * when dealing with the embedded loc file.
  */
-FILE* open_loc_file(const char* filename)
+static loc_file* open_loc_file(const char* filename)
 {
-	FILE* fd = NULL;
-	wchar_t *wfilename = NULL;
+	uint8_t* buf = NULL;
+	uint32_t size;
 	const char* tmp_ext = ".tmp";
 
 	if (filename == NULL)
@@ -220,19 +265,22 @@ FILE* open_loc_file(const char* filename)
 	} else {
 		loc_filename = safe_strdup(filename);
 	}
-	wfilename = utf8_to_wchar(filename);
-	if (wfilename == NULL) {
-		uprintf(conversion_error, filename);
-		goto out;
-	}
-	fd = _wfopen(wfilename, L"rb");
-	if (fd == NULL) {
+
+	// Reuse the data we already have if the file was previously opened
+	loc_fd.pos = 0;
+	if (safe_strcmp(loc_fd.path, filename) == 0)
+		return &loc_fd;
+
+	close_loc_file();
+	size = read_file(filename, &buf);
+	if (size == 0) {
 		uprintf("localization: could not open '%s'\n", filename);
+		return NULL;
 	}
-
-out:
-	safe_free(wfilename);
-	return fd;
+	loc_fd.path = safe_strdup(filename);
+	loc_fd.data = (char*)buf;
+	loc_fd.size = (long)size;
+	return &loc_fd;
 }
 
 /*
@@ -241,7 +289,7 @@ out:
  */
 BOOL get_supported_locales(const char* filename)
 {
-	FILE* fd = NULL;
+	loc_file* fd = NULL;
 	BOOL r = FALSE;
 	char line[1024];
 	size_t i, j, k;
@@ -255,30 +303,28 @@ BOOL get_supported_locales(const char* filename)
 		goto out;
 
 	// Check that the file doesn't contain a BOM and was saved in DOS mode
-	i = fread(line, 1, sizeof(line), fd);
-	if (i < sizeof(line)) {
+	if ((size_t)fd->size < sizeof(line)) {
 		uprintf("Invalid loc file: the file is too small!");
 		goto out;
 	}
-	if (((uint8_t)line[0]) > 0x80) {
+	if (((uint8_t)fd->data[0]) > 0x80) {
 		uprintf("Invalid loc file: the file should not have a BOM (Byte Order Mark)");
 		goto out;
 	}
 	for (i=0; i<sizeof(line)-1; i++)
-		if ((((uint8_t)line[i]) == 0x0D) && (((uint8_t)line[i+1]) == 0x0A)) break;
+		if ((((uint8_t)fd->data[i]) == 0x0D) && (((uint8_t)fd->data[i+1]) == 0x0A)) break;
 	if (i >= sizeof(line)-1) {
 		uprintf("Invalid loc file: the file MUST be saved in DOS mode (CR/LF)");
 		goto out;
 	}
-	fseek(fd, 0, SEEK_SET);
 
 	loc_line_nr = 0;
 	line[0] = 0;
 	free_locale_list();
 	do {
 		// adjust the last block
-		end_of_block = ftell(fd);
-		if (fgets(line, sizeof(line), fd) == NULL)
+		end_of_block = fd->pos;
+		if (loc_gets(line, sizeof(line), fd) == NULL)
 			break;
 		loc_line_nr++;
 		// Skip leading spaces
@@ -304,7 +350,7 @@ BOOL get_supported_locales(const char* filename)
 					last_lcmd->num[1] = (int32_t)end_of_block;
 				}
 			}
-			lcmd->num[0] = (int32_t)ftell(fd);
+			lcmd->num[0] = (int32_t)fd->pos;
 			// Add our locale command to the locale list
 			list_add_tail(&lcmd->list, &locale_list);
 			uprintf("localization: found locale '%s'\n", lcmd->txt[0]);
@@ -360,7 +406,7 @@ BOOL get_supported_locales(const char* filename)
 			list_del(&last_lcmd->list);
 			free_loc_cmd(last_lcmd);
 		} else {
-			last_lcmd->num[1] = (int32_t)ftell(fd);
+			last_lcmd->num[1] = (int32_t)fd->pos;
 		}
 	}
 	r = !list_empty(&locale_list);
@@ -368,8 +414,6 @@ BOOL get_supported_locales(const char* filename)
 		uprintf("localization: '%s' contains no valid locale sections\n", filename);
 
 out:
-	if (fd != NULL)
-		fclose(fd);
 	return r;
 }
 
@@ -380,7 +424,7 @@ out:
 BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd)
 {
 	size_t bufsize = 1024;
-	static FILE* fd = NULL;
+	static loc_file* fd = NULL;
 	static BOOL populate_default = FALSE;
 	char *buf = NULL;
 	size_t i = 0;
@@ -409,7 +453,7 @@ BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd)
 	if (reentrant) {
 		// Called, from a 'b' command - no need to reopen the file,
 		// just save the current offset and current line number
-		cur_offset = ftell(fd);
+		cur_offset = fd->pos;
 		old_loc_line_nr = loc_line_nr;
 	} else {
 		if ((filename == NULL) || (filename[0] == 0))
@@ -438,13 +482,14 @@ BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd)
 		goto out;
 	}
 
-	if (fseek(fd, offset, SEEK_SET) != 0) {
+	if ((offset < 0) || (offset > fd->size)) {
 		uprintf("localization: could not rewind\n");
 		goto out;
 	}
+	fd->pos = offset;
 
 	do {	// custom readline handling for string collation, realloc, line numbers, etc.
-		c = getc(fd);
+		c = loc_getc(fd);
 		switch(c) {
 		case EOF:
 			buf[i] = 0;
@@ -530,7 +575,7 @@ BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd)
 			}
 			break;
 		}
-		if ((c == EOF) || (ftell(fd) > end_offset))
+		if ((c == EOF) || (fd->pos > end_offset))
 			break;
 		// Have at least 2 chars extra, for \r\n sequences
 		if (i >= bufsize-2) {
@@ -551,13 +596,15 @@ BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd)
 out:
 	// Don't close on a reentrant call
 	if (reentrant) {
-		if ((cur_offset < 0) || (fseek(fd, cur_offset, SEEK_SET) != 0)) {
+		if ((cur_offset < 0) || (cur_offset > fd->size)) {
 			uprintf("localization: unable to reset reentrant position\n");
 			ret = FALSE;
+		} else {
+			fd->pos = cur_offset;
 		}
 		loc_line_nr = old_loc_line_nr;
-	} else if (fd != NULL) {
-		fclose(fd);
+	} else {
+		// The file data is kept for subsequent locale switches
 		fd = NULL;
 	}
 	safe_free(buf);
@@ -629,76 +676,261 @@ static wchar_t* get_token_data_line(const wchar_t* wtoken, wchar_t* wline)
 }
 
 /*
- * Parse a file (ANSI or UTF-8 or UTF-16) and return the data for the 'index'th occurrence of 'token'
- * The returned string is UTF-8 and MUST be freed by the caller
+ * Config file documents: the file is read once into an array of UTF-16 lines, against
+ * which any number of edits can be applied, and then written back, if modified, when
+ * the document is closed. The encoding of the original file (ANSI, UTF-8 with BOM or
+ * UTF-16 with BOM) is preserved.
  */
-char* get_token_data_file_indexed(const char* token, const char* filename, int index)
+#define CONFIG_DOC_INITIAL_LINES 64
+
+static BOOL config_doc_insert_line(config_doc* doc, uint32_t index, wchar_t* line)
 {
-	int i = 0;
-	wchar_t *wtoken = NULL, *wdata= NULL, *wfilename = NULL;
-	wchar_t buf[1024];
+	wchar_t** new_line;
+	size_t* new_start;
+
+	if (doc->nb_lines >= doc->max_lines) {
+		new_line = (wchar_t**)realloc(doc->line, 2 * doc->max_lines * sizeof(wchar_t*));
+		if (new_line == NULL)
+			return FALSE;
+		doc->line = new_line;
+		new_start = (size_t*)realloc(doc->start, 2 * doc->max_lines * sizeof(size_t));
+		if (new_start == NULL)
+			return FALSE;
+		doc->start = new_start;
+		doc->max_lines *= 2;
+	}
+	memmove(&doc->line[index + 1], &doc->line[index], (doc->nb_lines - index) * sizeof(wchar_t*));
+	memmove(&doc->start[index + 1], &doc->start[index], (doc->nb_lines - index) * sizeof(size_t));
+	doc->line[index] = line;
+	doc->start[index] = wcsspn(line, wspace);
+	doc->max_len = max(doc->max_len, wcslen(line));
+	doc->nb_lines++;
+	return TRUE;
+}
+
+static void config_doc_replace_line(config_doc* doc, uint32_t index, wchar_t* line)
+{
+	free(doc->line[index]);
+	doc->line[index] = line;
+	doc->start[index] = wcsspn(line, wspace);
+	doc->max_len = max(doc->max_len, wcslen(line));
+	doc->modified = TRUE;
+}
+
+/*
+ * Open a config file (ANSI or UTF-8 or UTF-16) for in-memory processing
+ * Returns NULL if the file can not be opened or read
+ */
+config_doc* open_config_doc(const char* filename)
+{
+	wchar_t buf[1024], *wline = NULL, *tmp, bom = 0;
+	size_t len, line_len = 0;
 	FILE* fd = NULL;
-	char *ret = NULL;
+	config_doc* doc = NULL;
 
-	if ((filename == NULL) || (token == NULL))
-		return NULL;
-	if ((filename[0] == 0) || (token[0] == 0))
+	if ((filename == NULL) || (filename[0] == 0))
 		return NULL;
 
-	wfilename = utf8_to_wchar(filename);
-	if (wfilename == NULL) {
+	doc = (config_doc*)calloc(1, sizeof(config_doc));
+	if (doc == NULL)
+		return NULL;
+	doc->path = safe_strdup(filename);
+	doc->wpath = utf8_to_wchar(filename);
+	if (doc->wpath == NULL) {
 		uprintf(conversion_error, filename);
+		goto err;
+	}
+	doc->line = (wchar_t**)malloc(CONFIG_DOC_INITIAL_LINES * sizeof(wchar_t*));
+	doc->start = (size_t*)malloc(CONFIG_DOC_INITIAL_LINES * sizeof(size_t));
+	if ((doc->path == NULL) || (doc->line == NULL) || (doc->start == NULL))
+		goto err;
+	doc->max_lines = CONFIG_DOC_INITIAL_LINES;
+
+	fd = _wfopen(doc->wpath, L"r, ccs=UNICODE");
+	if (fd == NULL)
+		goto err;
+
+	// Check the input file's BOM, so that we can write back a file with the same
+	if (fread(&bom, sizeof(bom), 1, fd) == 1) {
+		switch(bom) {
+		case 0xFEFF:
+			doc->mode = 2;	// UTF-16 (LE)
+			break;
+		case 0xBBEF:	// Yeah, the UTF-8 BOM is really 0xEF,0xBB,0xBF, but
+			doc->mode = 1;	// find me a non UTF-8 file that actually begins with "ï»"
+			break;
+		default:
+			doc->mode = 0;	// ANSI
+			break;
+		}
+		fseek(fd, 0, SEEK_SET);
+	}
+
+	// Process individual lines, which may be longer than our read buffer
+	while (fgetws(buf, ARRAYSIZE(buf), fd) != NULL) {
+		len = wcslen(buf);
+		tmp = (wchar_t*)realloc(wline, (line_len + len + 1) * sizeof(wchar_t));
+		if (tmp == NULL)
+			goto err;
+		wline = tmp;
+		wcscpy(&wline[line_len], buf);
+		line_len += len;
+		if ((len != 0) && (buf[len - 1] != L'\n'))
+			continue;
+		if (!config_doc_insert_line(doc, doc->nb_lines, wline))
+			goto err;
+		wline = NULL;
+		line_len = 0;
+	}
+	// Last line may not have an EOL
+	if ((wline != NULL) && (!config_doc_insert_line(doc, doc->nb_lines, wline)))
+		goto err;
+	fclose(fd);
+	return doc;
+
+err:
+	if (fd != NULL)
+		fclose(fd);
+	free(wline);
+	close_config_doc(doc, FALSE);
+	return NULL;
+}
+
+/*
+ * Close a config document, writing it back to disk if it was modified.
+ * If dos2unix is set, CRs are removed from the output.
+ * Returns FALSE if the document could not be written back.
+ */
+BOOL close_config_doc(config_doc* doc, BOOL dos2unix)
+{
+	const wchar_t* outmode[] = { L"w", L"w, ccs=UTF-8", L"w, ccs=UTF-16LE" };
+	wchar_t* wtmpname = NULL;
+	FILE *fd_in = NULL, *fd_out = NULL;
+	uint32_t i;
+	size_t size;
+	char tmp[2];
+	BOOL r = TRUE;
+
+	if (doc == NULL)
+		return FALSE;
+	if (!doc->modified || doc->wpath == NULL)
+		goto out;
+
+	r = FALSE;
+	wtmpname = (wchar_t*)calloc(wcslen(doc->wpath) + 2, sizeof(wchar_t));
+	if (wtmpname == NULL) {
+		uprintf("Could not allocate space for temporary output name\n");
+		goto out;
+	}
+	wcscpy(wtmpname, doc->wpath);
+	wtmpname[wcslen(wtmpname)] = '~';
+
+	fd_out = _wfopen(wtmpname, outmode[doc->mode]);
+	if (fd_out == NULL) {
+		uprintf("Could not open temporary output file '%s~'\n", doc->path);
 		goto out;
 	}
+	for (i = 0; i < doc->nb_lines; i++)
+		fputws(doc->line[i], fd_out);
+	fclose(fd_out);
+
+	// We're in Windows text mode => Remove CRs if requested
+	fd_in = _wfopen(wtmpname, L"rb");
+	fd_out = _wfopen(doc->wpath, L"wb");
+	// Don't check fds
+	if ((fd_in != NULL) && (fd_out != NULL)) {
+		size = (doc->mode == 2) ? 2 : 1;
+		while (fread(tmp, size, 1, fd_in) == 1) {
+			if ((!dos2unix) || (tmp[0] != 0x0D))
+				fwrite(tmp, size, 1, fd_out);
+		}
+		r = TRUE;
+	} else {
+		uprintf("Could not write '%s' - original file has been left unmodified\n", doc->path);
+	}
+	if (fd_in != NULL)
+		fclose(fd_in);
+	if (fd_out != NULL)
+		fclose(fd_out);
+
+out:
+	if (wtmpname != NULL)
+		_wunlink(wtmpname);
+	safe_free(wtmpname);
+	if (doc->line != NULL) {
+		for (i = 0; i < doc->nb_lines; i++)
+			free(doc->line[i]);
+	}
+	safe_free(doc->line);
+	safe_free(doc->start);
+	safe_free(doc->path);
+	safe_free(doc->wpath);
+	free(doc);
+	return r;
+}
+
+/*
+ * Return the data for the 'index'th occurrence of 'token' in a config document
+ * The returned string is UTF-8 and MUST be freed by the caller
+ */
+char* get_token_data_doc_indexed(config_doc* doc, const char* token, int index)
+{
+	int n = 0;
+	uint32_t i;
+	size_t j, token_len;
+	wchar_t *wtoken = NULL, *wdata, *wline = NULL;
+	char* ret = NULL;
+
+	if ((doc == NULL) || (token == NULL) || (token[0] == 0))
+		return NULL;
+
 	wtoken = utf8_to_wchar(token);
 	if (wtoken == NULL) {
 		uprintf(conversion_error, token);
 		goto out;
 	}
-	fd = _wfopen(wfilename, L"r, ccs=UNICODE");
-	if (fd == NULL) goto out;
+	token_len = wcslen(wtoken);
+	// get_token_data_line() modifies the line, so we use a scratch buffer
+	wline = (wchar_t*)malloc((doc->max_len + 1) * sizeof(wchar_t));
+	if (wline == NULL)
+		goto out;
 
-	// Process individual lines. NUL is always appended.
-	// Ideally, we'd check that our buffer fits the line
-	while (fgetws(buf, ARRAYSIZE(buf), fd) != NULL) {
-		wdata = get_token_data_line(wtoken, buf);
-		if ((wdata != NULL) && (++i == index)) {
+	for (i = 0; i < doc->nb_lines; i++) {
+		// Only duplicate the lines that start with our token
+		j = doc->start[i];
+		if (doc->line[i][j] == L'<')
+			j += 1 + wcsspn(&doc->line[i][j + 1], wspace);
+		if (_wcsnicmp(&doc->line[i][j], wtoken, token_len) != 0)
+			continue;
+		wcscpy(wline, doc->line[i]);
+		wdata = get_token_data_line(wtoken, wline);
+		if ((wdata != NULL) && (++n == index)) {
 			ret = wchar_to_utf8(wdata);
 			break;
 		}
 	}
 
 out:
-	if (fd != NULL)
-		fclose(fd);
-	safe_free(wfilename);
+	safe_free(wline);
 	safe_free(wtoken);
 	return ret;
 }
 
 /*
- * replace or add 'data' for token 'token' in config file 'filename'
+ * Replace or add 'data' for token 'token' in a config document
  */
-char* set_token_data_file(const char* token, const char* data, const char* filename)
+char* set_token_data_doc(config_doc* doc, const char* token, const char* data)
 {
-	const wchar_t* outmode[] = { L"w", L"w, ccs=UTF-8", L"w, ccs=UTF-16LE" };
-	wchar_t *wtoken = NULL, *wfilename = NULL, *wtmpname = NULL, *wdata = NULL, bom = 0;
-	wchar_t buf[1024];
-	FILE *fd_in = NULL, *fd_out = NULL;
-	size_t i, size;
-	int mode = 0;
-	char *ret = NULL, tmp[2];
+	uint32_t i;
+	size_t j, token_len;
+	wchar_t *wtoken = NULL, *wdata = NULL, *wline;
+	char* ret = NULL;
 
-	if ((filename == NULL) || (token == NULL) || (data == NULL))
+	if ((doc == NULL) || (token == NULL) || (data == NULL))
 		return NULL;
-	if ((filename[0] == 0) || (token[0] == 0) || (data[0] == 0))
+	if ((token[0] == 0) || (data[0] == 0))
 		return NULL;
 
-	wfilename = utf8_to_wchar(filename);
-	if (wfilename == NULL) {
-		uprintf(conversion_error, filename);
-		goto out;
-	}
 	wtoken = utf8_to_wchar(token);
 	if (wtoken == NULL) {
 		uprintf(conversion_error, token);
@@ -709,132 +941,249 @@ char* set_token_data_file(const char* token, const char* data, const char* filen
 		uprintf(conversion_error, data);
 		goto out;
 	}
+	token_len = wcslen(wtoken);
 
-	fd_in = _wfopen(wfilename, L"r, ccs=UNICODE");
-	if (fd_in == NULL) {
-		uprintf("Could not open file '%s'\n", filename);
-		goto out;
+	for (i = 0; i < doc->nb_lines; i++) {
+		j = doc->start[i];
+
+		// Ignore comments or section headers
+		if ((doc->line[i][j] == ';') || (doc->line[i][j] == '['))
+			continue;
+
+		// Our token should begin a line
+		if (_wcsnicmp(&doc->line[i][j], wtoken, token_len) != 0)
+			continue;
+
+		// Token was found, move past token and check for an equal sign
+		j += token_len;
+		j += wcsspn(&doc->line[i][j], wspace);
+		if (doc->line[i][j] != L'=')
+			continue;
+		j++;
+
+		// Skip spaces after equal sign
+		j += wcsspn(&doc->line[i][j], wspace);
+
+		// Keep the token and replace the data
+		wline = (wchar_t*)malloc((j + wcslen(wdata) + 2) * sizeof(wchar_t));
+		if (wline == NULL)
+			goto out;
+		wcsncpy(wline, doc->line[i], j);
+		wline[j] = 0;
+		wcscat(wline, wdata);
+		wcscat(wline, L"\n");
+		config_doc_replace_line(doc, i, wline);
+		ret = (char*)data;
 	}
-	// Check the input file's BOM and create an output file with the same
-	if (fread(&bom, sizeof(bom), 1, fd_in) == 1) {
-		switch(bom) {
-		case 0xFEFF:
-			mode = 2;	// UTF-16 (LE)
-			break;
-		case 0xBBEF:	// Yeah, the UTF-8 BOM is really 0xEF,0xBB,0xBF, but
-			mode = 1;	// find me a non UTF-8 file that actually begins with "ï»"
-			break;
-		default:
-			mode = 0;	// ANSI
-			break;
+
+	if (ret == NULL) {
+		// Didn't find an existing token => append it
+		wline = (wchar_t*)malloc((token_len + wcslen(wdata) + 5) * sizeof(wchar_t));
+		if (wline == NULL)
+			goto out;
+		wcscpy(wline, wtoken);
+		wcscat(wline, L" = ");
+		wcscat(wline, wdata);
+		wcscat(wline, L"\n");
+		if (!config_doc_insert_line(doc, doc->nb_lines, wline)) {
+			free(wline);
+			goto out;
 		}
-		fseek(fd_in, 0, SEEK_SET);
+		doc->modified = TRUE;
+		ret = (char*)data;
 	}
 
-	wtmpname = (wchar_t*)calloc(wcslen(wfilename)+2, sizeof(wchar_t));
-	if (wtmpname == NULL) {
-		uprintf("Could not allocate space for temporary output name\n");
+out:
+	safe_free(wtoken);
+	safe_free(wdata);
+	return ret;
+}
+
+/*
+ * Insert entry 'data' under section 'section' of a config document
+ * Section must include the relevant delimiters (eg '[', ']') if needed
+ */
+char* insert_section_data_doc(config_doc* doc, const char* section, const char* data)
+{
+	uint32_t i;
+	wchar_t *wsection = NULL, *wdata = NULL, *wline;
+	char* ret = NULL;
+
+	if ((doc == NULL) || (section == NULL) || (data == NULL))
+		return NULL;
+	if ((section[0] == 0) || (data[0] == 0))
+		return NULL;
+
+	wsection = utf8_to_wchar(section);
+	if (wsection == NULL) {
+		uprintf(conversion_error, section);
 		goto out;
 	}
-	wcscpy(wtmpname, wfilename);
-	wtmpname[wcslen(wtmpname)] = '~';
-
-	fd_out = _wfopen(wtmpname, outmode[mode]);
-	if (fd_out == NULL) {
-		uprintf("Could not open temporary output file '%s~'\n", filename);
+	wdata = utf8_to_wchar(data);
+	if (wdata == NULL) {
+		uprintf(conversion_error, data);
 		goto out;
 	}
 
-	// Process individual lines. NUL is always appended.
-	while (fgetws(buf, ARRAYSIZE(buf), fd_in) != NULL) {
+	for (i = 0; i < doc->nb_lines; i++) {
+		// Our section should begin a line
+		if (_wcsnicmp(&doc->line[i][doc->start[i]], wsection, wcslen(wsection)) != 0)
+			continue;
 
-		i = 0;
+		// Section was found, insert the new data after it
+		wline = (wchar_t*)malloc((wcslen(wdata) + 2) * sizeof(wchar_t));
+		if (wline == NULL)
+			goto out;
+		wcscpy(wline, wdata);
+		wcscat(wline, L"\n");
+		if (!config_doc_insert_line(doc, ++i, wline)) {
+			free(wline);
+			goto out;
+		}
+		doc->modified = TRUE;
+		ret = (char*)data;
+	}
 
-		// Skip leading spaces
-		i += wcsspn(&buf[i], wspace);
+out:
+	safe_free(wsection);
+	safe_free(wdata);
+	return ret;
+}
 
-		// Ignore comments or section headers
-		if ((buf[i] == ';') || (buf[i] == '[')) {
-			fputws(buf, fd_out);
-			continue;
-		}
+/*
+ * Search for a specific 'src' substring data for all occurrences of 'token', and replace
+ * it with 'rep' in a config document. Parameters are UTF-8.
+ * The parsed line is of the form: [ ]token[ ]data
+ * Returns a pointer to rep if replacement occurred, NULL otherwise
+ * TODO: We might have to end up with a regexp engine, so that we can do stuff like: "foo*" -> "bar\1"
+ */
+#define MAX_OCCURRENCES 4
+char* replace_in_token_data_doc(config_doc* doc, const char* token, const char* src, const char* rep)
+{
+	uint32_t i;
+	size_t j, k, n, ns, token_len, src_len, rep_len;
+	wchar_t *wtoken = NULL, *wsrc = NULL, *wrep = NULL, *wline, *p, *q;
+	char* ret = NULL;
+
+	if ((doc == NULL) || (token == NULL) || (src == NULL) || (rep == NULL))
+		return NULL;
+	if ((token[0] == 0) || (src[0] == 0))
+		return NULL;
+	if (strcmp(src, rep) == 0)	// No need for processing is source is same as replacement
+		return NULL;
+
+	wtoken = utf8_to_wchar(token);
+	if (wtoken == NULL) {
+		uprintf(conversion_error, token);
+		goto out;
+	}
+	wsrc = utf8_to_wchar(src);
+	if (wsrc == NULL) {
+		uprintf(conversion_error, src);
+		goto out;
+	}
+	wrep = utf8_to_wchar(rep);
+	if (wrep == NULL) {
+		uprintf(conversion_error, rep);
+		goto out;
+	}
+	token_len = wcslen(wtoken);
+	src_len = wcslen(wsrc);
+	rep_len = wcslen(wrep);
+
+	for (i = 0; i < doc->nb_lines; i++) {
+		j = doc->start[i];
 
 		// Our token should begin a line
-		if (_wcsnicmp(&buf[i], wtoken, wcslen(wtoken)) != 0) {
-			fputws(buf, fd_out);
+		if (_wcsnicmp(&doc->line[i][j], wtoken, token_len) != 0)
 			continue;
-		}
 
 		// Token was found, move past token
-		i += wcslen(wtoken);
-
-		// Skip spaces
-		i += wcsspn(&buf[i], wspace);
+		j += token_len;
 
-		// Check for an equal sign
-		if (buf[i] != L'=') {
-			fputws(buf, fd_out);
+		// Skip whitespaces after token (while making sure there's at least one)
+		ns = wcsspn(&doc->line[i][j], wspace);
+		if (ns == 0)
 			continue;
-		}
-		i++;
+		j += ns;
 
-		// Skip spaces after equal sign
-		i += wcsspn(&buf[i], wspace);
+		// Count the replaceable strings
+		for (n = 0, p = &doc->line[i][j]; (n < MAX_OCCURRENCES) && ((p = wcsstr(p, wsrc)) != NULL); n++)
+			p += src_len;
 
-		// Output the token
-		buf[i] = 0;
-		fputws(buf, fd_out);
+		// No replaceable string found => leave line as is
+		if (n == 0)
+			continue;
 
-		// Now output the new data
-		// coverity[invalid_type]
-		fwprintf_s(fd_out, L"%s\n", wdata);
-		ret = (char*)data;
-	}
+		wline = (wchar_t*)malloc((wcslen(doc->line[i]) + n * rep_len + 1) * sizeof(wchar_t));
+		if (wline == NULL)
+			goto out;
 
-	if (ret == NULL) {
-		// Didn't find an existing token => append it
-		// coverity[invalid_type]
-		fwprintf_s(fd_out, L"%s = %s\n", wtoken, wdata);
-		ret = (char*)data;
+		// Copy all the fragments + replaced strings, and then the last fragment
+		for (k = 0, q = doc->line[i], p = &doc->line[i][j]; n > 0; n--) {
+			p = wcsstr(p, wsrc);
+			memcpy(&wline[k], q, (p - q) * sizeof(wchar_t));
+			k += p - q;
+			memcpy(&wline[k], wrep, rep_len * sizeof(wchar_t));
+			k += rep_len;
+			p += src_len;
+			q = p;
+		}
+		wcscpy(&wline[k], q);
+		config_doc_replace_line(doc, i, wline);
+		ret = (char*)rep;
 	}
 
 out:
-	if (fd_in != NULL) {
-		fclose(fd_in);
-		fd_in = NULL;
-	}
-	if (fd_out != NULL)
-		fclose(fd_out);
-
-	// If an insertion occurred, delete existing file and use the new one
-	if (ret != NULL) {
-		// We're in Windows text mode => Remove CRs if requested
-		if (wtmpname != NULL)
-			fd_in = _wfopen(wtmpname, L"rb");
-		fd_out = _wfopen(wfilename, L"wb");
-		// Don't check fds
-		if ((fd_in != NULL) && (fd_out != NULL)) {
-			size = (mode==2)?2:1;
-			while(fread(tmp, size, 1, fd_in) == 1)
-				fwrite(tmp, size, 1, fd_out);
-			fclose(fd_in);
-			fclose(fd_out);
-		} else {
-			uprintf("Could not write '%s' - original file has been left unmodified\n", filename);
-			ret = NULL;
-			if (fd_in != NULL)
-				fclose(fd_in);
-			if (fd_out != NULL)
-				fclose(fd_out);
-		}
-	}
-	if (wtmpname != NULL)
-		_wunlink(wtmpname);
-	safe_free(wfilename);
-	safe_free(wtmpname);
 	safe_free(wtoken);
-	safe_free(wdata);
+	safe_free(wsrc);
+	safe_free(wrep);
+	return ret;
+}
+
+/*
+ * Parse a file (ANSI or UTF-8 or UTF-16) and return the data for the 'index'th occurrence of 'token'
+ * The returned string is UTF-8 and MUST be freed by the caller
+ */
+char* get_token_data_file_indexed(const char* token, const char* filename, int index)
+{
+	config_doc* doc;
+	char* ret;
+
+	if ((filename == NULL) || (token == NULL))
+		return NULL;
+	if ((filename[0] == 0) || (token[0] == 0))
+		return NULL;
 
+	doc = open_config_doc(filename);
+	if (doc == NULL)
+		return NULL;
+	ret = get_token_data_doc_indexed(doc, token, index);
+	close_config_doc(doc, FALSE);
+	return ret;
+}
+
+/*
+ * replace or add 'data' for token 'token' in config file 'filename'
+ */
+char* set_token_data_file(const char* token, const char* data, const char* filename)
+{
+	config_doc* doc;
+	char* ret;
+
+	if ((filename == NULL) || (token == NULL) || (data == NULL))
+		return NULL;
+	if ((filename[0] == 0) || (token[0] == 0) || (data[0] == 0))
+		return NULL;
+
+	doc = open_config_doc(filename);
+	if (doc == NULL) {
+		uprintf("Could not open file '%s'\n", filename);
+		return NULL;
+	}
+	ret = set_token_data_doc(doc, token, data);
+	if (!close_config_doc(doc, FALSE))
+		ret = NULL;
 	return ret;
 }
 
@@ -967,148 +1316,34 @@ void parse_update(char* buf, size_t len)
  */
 char* insert_section_data(const char* filename, const char* section, const char* data, BOOL dos2unix)
 {
-	const wchar_t* outmode[] = { L"w", L"w, ccs=UTF-8", L"w, ccs=UTF-16LE" };
-	wchar_t *wsection = NULL, *wfilename = NULL, *wtmpname = NULL, *wdata = NULL, bom = 0;
-	wchar_t buf[1024];
-	FILE *fd_in = NULL, *fd_out = NULL;
-	size_t i, size;
-	int mode = 0;
-	char *ret = NULL, tmp[2];
+	config_doc* doc;
+	char* ret;
 
 	if ((filename == NULL) || (section == NULL) || (data == NULL))
 		return NULL;
 	if ((filename[0] == 0) || (section[0] == 0) || (data[0] == 0))
 		return NULL;
 
-	wfilename = utf8_to_wchar(filename);
-	if (wfilename == NULL) {
-		uprintf(conversion_error, filename);
-		goto out;
-	}
-	wsection = utf8_to_wchar(section);
-	if (wsection == NULL) {
-		uprintf(conversion_error, section);
-		goto out;
-	}
-	wdata = utf8_to_wchar(data);
-	if (wdata == NULL) {
-		uprintf(conversion_error, data);
-		goto out;
-	}
-
-	fd_in = _wfopen(wfilename, L"r, ccs=UNICODE");
-	if (fd_in == NULL) {
+	doc = open_config_doc(filename);
+	if (doc == NULL) {
 		uprintf("Could not open file '%s'\n", filename);
-		goto out;
-	}
-	// Check the input file's BOM and create an output file with the same
-	if (fread(&bom, sizeof(bom), 1, fd_in) != 1) {
-		uprintf("Could not read file '%s'\n", filename);
-		goto out;
-	}
-	switch(bom) {
-	case 0xFEFF:
-		mode = 2;	// UTF-16 (LE)
-		break;
-	case 0xBBEF:	// Yeah, the UTF-8 BOM is really 0xEF,0xBB,0xBF, but
-		mode = 1;	// find me a non UTF-8 file that actually begins with "ï»"
-		break;
-	default:
-		mode = 0;	// ANSI
-		break;
-	}
-	fseek(fd_in, 0, SEEK_SET);
-//	duprintf("'%s' was detected as %s\n", filename,
-//		(mode==0)?"ANSI/UTF8 (no BOM)":((mode==1)?"UTF8 (with BOM)":"UTF16 (with BOM"));
-
-	wtmpname = (wchar_t*)calloc(wcslen(wfilename)+2, sizeof(wchar_t));
-	if (wtmpname == NULL) {
-		uprintf("Could not allocate space for temporary output name\n");
-		goto out;
-	}
-	wcscpy(wtmpname, wfilename);
-	wtmpname[wcslen(wtmpname)] = '~';
-
-	fd_out = _wfopen(wtmpname, outmode[mode]);
-	if (fd_out == NULL) {
-		uprintf("Could not open temporary output file '%s~'\n", filename);
-		goto out;
-	}
-
-	// Process individual lines. NUL is always appended.
-	while (fgetws(buf, ARRAYSIZE(buf), fd_in) != NULL) {
-
-		i = 0;
-
-		// Skip leading spaces
-		i += wcsspn(&buf[i], wspace);
-
-		// Our token should begin a line
-		if (_wcsnicmp(&buf[i], wsection, wcslen(wsection)) != 0) {
-			fputws(buf, fd_out);
-			continue;
-		}
-
-		// Section was found, output it
-		fputws(buf, fd_out);
-		// Now output the new data
-		// coverity[invalid_type]
-		fwprintf_s(fd_out, L"%s\n", wdata);
-		ret = (char*)data;
-	}
-
-out:
-	if (fd_in != NULL) fclose(fd_in);
-	if (fd_out != NULL) fclose(fd_out);
-
-	// If an insertion occurred, delete existing file and use the new one
-	if (ret != NULL && wtmpname != NULL && wfilename != NULL) {
-		// We're in Windows text mode => Remove CRs if requested
-		fd_in = _wfopen(wtmpname, L"rb");
-		fd_out = _wfopen(wfilename, L"wb");
-		// Don't check fds
-		if ((fd_in != NULL) && (fd_out != NULL)) {
-			size = (mode==2)?2:1;
-			while(fread(tmp, size, 1, fd_in) == 1) {
-				if ((!dos2unix) || (tmp[0] != 0x0D))
-					fwrite(tmp, size, 1, fd_out);
-			}
-			fclose(fd_in);
-			fclose(fd_out);
-		} else {
-			uprintf("Could not write '%s' - original file has been left unmodified\n", filename);
-			ret = NULL;
-			if (fd_in != NULL) fclose(fd_in);
-			if (fd_out != NULL) fclose(fd_out);
-		}
+		return NULL;
 	}
-	if (wtmpname != NULL)
-		_wunlink(wtmpname);
-	safe_free(wfilename);
-	safe_free(wtmpname);
-	safe_free(wsection);
-	safe_free(wdata);
-
+	ret = insert_section_data_doc(doc, section, data);
+	if (!close_config_doc(doc, dos2unix))
+		ret = NULL;
 	return ret;
 }
 
 /*
  * Search for a specific 'src' substring data for all occurrences of 'token', and replace
  * it with 'rep'. File can be ANSI or UNICODE and is overwritten. Parameters are UTF-8.
- * The parsed line is of the form: [ ]token[ ]data
  * Returns a pointer to rep if replacement occurred, NULL otherwise
- * TODO: We might have to end up with a regexp engine, so that we can do stuff like: "foo*" -> "bar\1"
  */
-#define MAX_OCCURRENCES 4
 char* replace_in_token_data(const char* filename, const char* token, const char* src, const char* rep, BOOL dos2unix)
 {
-	const wchar_t* outmode[] = { L"w", L"w, ccs=UTF-8", L"w, ccs=UTF-16LE" };
-	wchar_t *wtoken = NULL, *wfilename = NULL, *wtmpname = NULL, *wsrc = NULL, *wrep = NULL, bom = 0;
-	wchar_t buf[1024], *torep[MAX_OCCURRENCES + 1] = { NULL };
-	FILE *fd_in = NULL, *fd_out = NULL;
-	size_t i, j, p[MAX_OCCURRENCES + 1] = { 0 }, ns, size;
-	int mode = 0;
-	char *ret = NULL, tmp[2];
+	config_doc* doc;
+	char* ret;
 
 	if ((filename == NULL) || (token == NULL) || (src == NULL) || (rep == NULL))
 		return NULL;
@@ -1117,156 +1352,14 @@ char* replace_in_token_data(const char* filename, const char* token, const char*
 	if (strcmp(src, rep) == 0)	// No need for processing is source is same as replacement
 		return NULL;
 
-	wfilename = utf8_to_wchar(filename);
-	if (wfilename == NULL) {
-		uprintf(conversion_error, filename);
-		goto out;
-	}
-	wtoken = utf8_to_wchar(token);
-	if (wtoken == NULL) {
-		uprintf(conversion_error, token);
-		goto out;
-	}
-	wsrc = utf8_to_wchar(src);
-	if (wsrc == NULL) {
-		uprintf(conversion_error, src);
-		goto out;
-	}
-	wrep = utf8_to_wchar(rep);
-	if (wrep == NULL) {
-		uprintf(conversion_error, rep);
-		goto out;
-	}
-
-	fd_in = _wfopen(wfilename, L"r, ccs=UNICODE");
-	if (fd_in == NULL) {
+	doc = open_config_doc(filename);
+	if (doc == NULL) {
 		uprintf("Could not open file '%s'\n", filename);
-		goto out;
-	}
-	// Check the input file's BOM and create an output file with the same
-	if (fread(&bom, sizeof(bom), 1, fd_in) != 1) {
-		if (!feof(fd_in))
-			uprintf("Could not read file '%s'\n", filename);
-		goto out;
-	}
-	switch(bom) {
-	case 0xFEFF:
-		mode = 2;	// UTF-16 (LE)
-		break;
-	case 0xBBEF:	// Yeah, the UTF-8 BOM is really 0xEF,0xBB,0xBF, but
-		mode = 1;	// find me a non UTF-8 file that actually begins with "ï»"
-		break;
-	default:
-		mode = 0;	// ANSI
-		break;
-	}
-	fseek(fd_in, 0, SEEK_SET);
-//	duprintf("'%s' was detected as %s\n", filename,
-//		(mode==0)?"ANSI/UTF8 (no BOM)":((mode==1)?"UTF8 (with BOM)":"UTF16 (with BOM"));
-
-	wtmpname = (wchar_t*)calloc(wcslen(wfilename)+2, sizeof(wchar_t));
-	if (wtmpname == NULL) {
-		uprintf("Could not allocate space for temporary output name\n");
-		goto out;
-	}
-	wcscpy(wtmpname, wfilename);
-	wtmpname[wcslen(wtmpname)] = '~';
-
-	fd_out = _wfopen(wtmpname, outmode[mode]);
-	if (fd_out == NULL) {
-		uprintf("Could not open temporary output file '%s~'\n", filename);
-		goto out;
-	}
-
-	// Process individual lines. NUL is always appended.
-	while (fgetws(buf, ARRAYSIZE(buf), fd_in) != NULL) {
-
-		i = 0;
-
-		// Skip leading spaces
-		i += wcsspn(&buf[i], wspace);
-
-		// Our token should begin a line
-		if (_wcsnicmp(&buf[i], wtoken, wcslen(wtoken)) != 0) {
-			fputws(buf, fd_out);
-			continue;
-		}
-
-		// Token was found, move past token
-		i += wcslen(wtoken);
-
-		// Skip whitespaces after token (while making sure there's at least one)
-		ns = wcsspn(&buf[i], wspace);
-		if (ns == 0) {
-			fputws(buf, fd_out);
-			continue;
-		}
-		i += ns;
-
-		// p[x] = starting position of the fragment with the replaceable string
-		p[0] = 0;
-		for (j = 0; j < MAX_OCCURRENCES; j++) {
-			torep[j] = wcsstr(&buf[i], wsrc);
-			if (torep[j] == NULL)
-				break;
-			// Next fragment will start after current + replaced string
-			i = (torep[j] - buf) + wcslen(wsrc);
-			p[j + 1] = i;
-			// Truncate each fragment to before the replaced string
-			*torep[j] = 0;
-		}
-
-		// No replaceable string found => output as is
-		if (torep[0] == NULL) {
-			fputws(buf, fd_out);
-			continue;
-		}
-
-		// Output all the truncated fragments + replaced strings
-		for (j = 0; torep[j] != NULL; j++)
-			// coverity[invalid_type]
-			fwprintf_s(fd_out, L"%s%s", &buf[p[j]], wrep);
-
-		// Output the last fragment
-		// coverity[invalid_type]
-		fwprintf_s(fd_out, L"%s", &buf[p[j]]);
-
-		ret = (char*)rep;
-	}
-
-out:
-	if (fd_in != NULL) fclose(fd_in);
-	if (fd_out != NULL) fclose(fd_out);
-
-	// If a replacement occurred, delete existing file and use the new one
-	if (ret != NULL && wtmpname != NULL && wfilename != NULL) {
-		// We're in Windows text mode => Remove CRs if requested
-		fd_in = _wfopen(wtmpname, L"rb");
-		fd_out = _wfopen(wfilename, L"wb");
-		// Don't check fds
-		if ((fd_in != NULL) && (fd_out != NULL)) {
-			size = (mode==2)?2:1;
-			while(fread(tmp, size, 1, fd_in) == 1) {
-				if ((!dos2unix) || (tmp[0] != 0x0D))
-					fwrite(tmp, size, 1, fd_out);
-			}
-			fclose(fd_in);
-			fclose(fd_out);
-		} else {
-			uprintf("Could not write '%s' - original file has been left unmodified.\n", filename);
-			ret = NULL;
-			if (fd_in != NULL) fclose(fd_in);
-			if (fd_out != NULL) fclose(fd_out);
-		}
+		return NULL;
 	}
-	if (wtmpname != NULL)
-		_wunlink(wtmpname);
-	safe_free(wfilename);
-	safe_free(wtmpname);
-	safe_free(wtoken);
-	safe_free(wsrc);
-	safe_free(wrep);
-
+	ret = replace_in_token_data_doc(doc, token, src, rep);
+	if (!close_config_doc(doc, dos2unix))
+		ret = NULL;
 	return ret;
 }
 
@@ -313,14 +313,14 @@ char* GetSignatureName(const char* path, const char* country_code, uint8_t* thum
 	// Get signer information size.
 	r = CryptMsgGetParam(hMsg, CMSG_SIGNER_INFO_PARAM, 0, NULL, &dwSignerInfoSize);
 	if (!r) {
-		uprintf("PKI: Failed to get signer size: %s", WinPKIErrorString());
+		PkiError("Failed to get signer size", TRUE, error, error_code);
 		goto out;
 	}
 
 	// Allocate memory for signer information.
 	pSignerInfo = (PCMSG_SIGNER_INFO)calloc(dwSignerInfoSize, 1);
 	if (!pSignerInfo) {
-		uprintf("PKI: Could not allocate memory for signer information");
+		PkiError("Could not allocate memory for signer information", FALSE, error, error_code);
 		goto out;
 	}
 
@@ -336,7 +336,7 @@ char* GetSignatureName(const char* path, const char* country_code, uint8_t* thum
 	CertInfo.SerialNumber = pSignerInfo->SerialNumber;
 	pCertContext = CertFindCertificateInStore(hStore, ENCODING, 0, CERT_FIND_SUBJECT_CERT, (PVOID)&CertInfo, NULL);
 	if (!pCertContext) {
-		uprintf("PKI: Failed to locate signer certificate in store: %s", WinPKIErrorString());
+		PkiError("Failed to locate signer certificate in store", TRUE, error, error_code);
 		goto out;
 	}
 
@@ -345,7 +345,7 @@ char* GetSignatureName(const char* path, const char* country_code, uint8_t* thum
 		dwSize = SHA1_HASHSIZE;
 		if (!CryptHashCertificate(0, CALG_SHA1, 0, pCertContext->pbCertEncoded,
 			pCertContext->cbCertEncoded, thumbprint, &dwSize)) {
-			uprintf("PKI: Failed to compute the thumbprint: %s", WinPKIErrorString());
+			PkiError("Failed to compute the thumbprint", TRUE, error, error_code);
 			goto out;
 		}
 	}
@@ -368,7 +368,7 @@ char* GetSignatureName(const char* path, const char* country_code, uint8_t* thum
 	dwSize = CertGetNameStringA(pCertContext, CERT_NAME_ATTR_TYPE, 0, szOID_COMMON_NAME,
 		szSubjectName, sizeof(szSubjectName));
 	if (dwSize <= 1) {
-		uprintf("PKI: Failed to get Subject Name");
+		PkiError("Failed to get Subject Name", FALSE, error, error_code);
 		goto out;
 	}
 
@@ -394,10 +394,30 @@ out:
 	return p;
 }
 
+/*
+ * Report a PKI error, either by logging it right away or, if error is not NULL, by
+ * recording it for the caller to log later on. The latter is meant for worker threads,
+ * since WinPKIErrorString() and WindowsErrorString() use a shared static buffer.
+ */
+static void PkiError(const char* msg, BOOL has_code, const char** error, DWORD* error_code)
+{
+	if (error == NULL) {
+		if (has_code)
+			uprintf("PKI: %s: %s", msg, WinPKIErrorString());
+		else
+			uprintf("PKI: %s", msg);
+		return;
+	}
+	*error = msg;
+	if (error_code != NULL)
+		*error_code = has_code ? GetLastError() : 0;
+}
+
 // Fills the certificate's name and thumbprint.
 // Tries the issuer first, and if none is available, falls back to current cert.
 // Returns 0 for unsigned, -1 on error, 1 for signer or 2 for issuer.
-int GetIssuerCertificateInfo(uint8_t* cert, cert_info_t* info)
+// If error is not NULL, errors are returned there, along with their code, instead of being logged.
+int GetIssuerCertificateInfo(uint8_t* cert, cert_info_t* info, const char** error, DWORD* error_code)
 {
 	int ret = 0;
 	DWORD dwSize, dwEncoding, dwContentType, dwFormatType, dwSignerInfoSize = 0;
@@ -422,7 +442,7 @@ int GetIssuerCertificateInfo(uint8_t* cert, cert_info_t* info)
 	if (!CryptQueryObject(CERT_QUERY_OBJECT_BLOB, &signedDataBlob,
 		CERT_QUERY_CONTENT_FLAG_PKCS7_SIGNED, CERT_QUERY_FORMAT_FLAG_BINARY,
 		0, &dwEncoding, &dwContentType, &dwFormatType, &hStore, &hMsg, NULL)) {
-		uprintf("PKI: Failed to get signature: %s", WinPKIErrorString());
+		PkiError("Failed to get signature", TRUE, error, error_code);
 		goto out;
 	}
 
@@ -441,7 +461,7 @@ int GetIssuerCertificateInfo(uint8_t* cert, cert_info_t* info)
 
 	// Get Signer Information.
 	if (!CryptMsgGetParam(hMsg, CMSG_SIGNER_CERT_INFO_PARAM, 0, pSignerInfo, &dwSignerInfoSize)) {
-		uprintf("PKI: Failed to get signer info: %s", WinPKIErrorString());
+		PkiError("Failed to get signer info", TRUE, error, error_code);
 		goto out;
 	}
 
@@ -457,7 +477,7 @@ int GetIssuerCertificateInfo(uint8_t* cert, cert_info_t* info)
 	chainPara.cbSize = sizeof(CERT_CHAIN_PARA);
 	if (!CertGetCertificateChain(NULL, pCertContext[0], NULL, hStore, &chainPara,
 		CERT_CHAIN_CACHE_ONLY_URL_RETRIEVAL | CERT_CHAIN_REVOCATION_CHECK_CACHE_ONLY, NULL, &pChainContext)) {
-		uprintf("PKI: Failed to build certificate chain. Error code: %s", WinPKIErrorString());
+		PkiError("Failed to build certificate chain", TRUE, error, error_code);
 		goto out;
 	}
 
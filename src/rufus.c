@@ -950,6 +950,12 @@ out:
 	return TRUE;
 }
 
+// Timer that adds the messages logged by other threads to the log window
+static void CALLBACK LogTimer(HWND hWnd, UINT uMsg, UINT_PTR idEvent, DWORD dwTime)
+{
+	uflush();
+}
+
 // Callback for the log window
 BOOL CALLBACK LogCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam)
 {
@@ -991,8 +997,11 @@ BOOL CALLBACK LogCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam)
 		style &= ~(ES_RIGHT);
 		SetWindowLongPtr(hLog, GWL_STYLE, style);
 		SetDarkModeForChild(hDlg);
+		// Refresh the log at about 30 fps
+		SetTimer(hDlg, TID_LOG_TIMER, 33, LogTimer);
 		break;
 	case WM_NCDESTROY:
+		KillTimer(hDlg, TID_LOG_TIMER);
 		safe_delete_object(hf);
 		break;
 	case WM_COMMAND:
@@ -1005,9 +1014,11 @@ BOOL CALLBACK LogCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam)
 			SendMessage(hMainDialog, WM_NEXTDLGCTL, (WPARAM)GetDlgItem(hMainDialog, IDCANCEL), TRUE);
 			return TRUE;
 		case IDC_LOG_CLEAR:
+			uflush();
 			SetWindowTextA(hLog, "");
 			return TRUE;
 		case IDC_LOG_SAVE:
+			uflush();
 			log_size = GetWindowTextLengthU(hLog);
 			if (log_size <= 0)
 				break;
@@ -1253,10 +1264,10 @@ out:
 void GetBootladerInfo(void)
 {
 	static const char* revocation_type[] = { "UEFI DBX", "Windows SSP", "Linux SBAT", "Windows SVN", "Cert DBX" };
-	int r;
-	BOOL sb_signed;
-	uint32_t i, len;
-	uint8_t* buf = NULL;
+	const char* path[ARRAYSIZE(img_report.efi_boot_entry)];
+	uint8_t* buf[ARRAYSIZE(img_report.efi_boot_entry)];
+	uint32_t i, n, count, len[ARRAYSIZE(img_report.efi_boot_entry)];
+	bootloader_check_t* bl = NULL;
 
 	// Check UEFI bootloaders for revocation
 	if (!IS_EFI_BOOTABLE(img_report))
@@ -1265,25 +1276,42 @@ void GetBootladerInfo(void)
 	assert(ARRAYSIZE(img_report.efi_boot_entry) > 0);
 	PrintStatus(0, MSG_351);
 	uprintf("UEFI bootloaders analysis:");
-	for (i = 0; i < ARRAYSIZE(img_report.efi_boot_entry) && img_report.efi_boot_entry[i].path[0] != 0; i++) {
-		len = ReadISOFileToBuffer(image_path, img_report.efi_boot_entry[i].path, &buf);
-		if (len == 0) {
-			uprintf("  Warning: Failed to extract '%s' to check for UEFI Secure Boot info", img_report.efi_boot_entry[i].path);
+	for (count = 0; count < ARRAYSIZE(img_report.efi_boot_entry) && img_report.efi_boot_entry[count].path[0] != 0; count++)
+		path[count] = img_report.efi_boot_entry[count].path;
+	if (count == 0)
+		return;
+
+	// Read all the bootloaders in a single pass, then check them as a batch
+	ReadISOFilesToBuffers(image_path, count, path, buf, len);
+	bl = calloc(count, sizeof(bootloader_check_t));
+	if (bl == NULL)
+		goto out;
+	for (i = 0, n = 0; i < count; i++) {
+		if (len[i] == 0) {
+			uprintf("  Warning: Failed to extract '%s' to check for UEFI Secure Boot info", path[i]);
 			continue;
 		}
-		sb_signed = IsSignedBySecureBootAuthority(buf, len);
-		if (sb_signed)
+		bl[n].path = path[i];
+		bl[n].buf = buf[i];
+		bl[n++].len = len[i];
+	}
+	CheckBootloaders(bl, n);
+
+	for (i = 0; i < n; i++) {
+		if (bl[i].sb_signed)
 			img_report.has_secureboot_bootloader |= 1;
-		uprintf("  • %s%s", img_report.efi_boot_entry[i].path, sb_signed ? "*" : "");
-		r = IsBootloaderRevoked(buf, len);
-		if (r > 0) {
-			assert(r <= ARRAYSIZE(revocation_type));
-			assert(r <= 7);
-			uprintf("  WARNING: '%s' has been revoked by %s", img_report.efi_boot_entry[i].path, revocation_type[r - 1]);
-			img_report.has_secureboot_bootloader |= 1 << r;
+		if (bl[i].revoked > 0) {
+			assert(bl[i].revoked <= ARRAYSIZE(revocation_type));
+			assert(bl[i].revoked <= 7);
+			uprintf("  WARNING: '%s' has been revoked by %s", bl[i].path, revocation_type[bl[i].revoked - 1]);
+			img_report.has_secureboot_bootloader |= 1 << bl[i].revoked;
 		}
-		safe_free(buf);
 	}
+
+out:
+	for (i = 0; i < count; i++)
+		safe_free(buf[i]);
+	free(bl);
 }
 
 // The scanning process can be blocking for message processing => use a thread
@@ -2371,6 +2399,7 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 			}
 
 			// Save or append the current log to %LocalAppData%\Rufus\rufus.log
+			uflush();
 			log_size = GetWindowTextLengthU(hLog);
 			if ((!user_deleted_rufus_dir) && (log_size > 0) && ((log_buffer = (char*)malloc(log_size + 2)) != NULL)) {
 				log_size = GetDlgItemTextU(hLogDialog, IDC_LOG_EDIT, log_buffer, log_size);
@@ -4316,6 +4345,7 @@ out:
 	safe_free(fido_url);
 	safe_free(fido_script);
 	safe_free(pe256ssp);
+	FreeDbx();
 	safe_free(sbat_entries);
 	safe_free(sbat_level_txt);
 	safe_free(sb_active_certs);
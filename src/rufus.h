@@ -116,7 +116,7 @@
 #define FAT32_CLUSTER_THRESHOLD     1.011f		// For FAT32, cluster size changes don't occur at power of 2 boundaries but slightly above
 #define DD_BUFFER_SIZE              (32 * MB)	// Minimum size of buffer to use for DD operations
 #define UBUFFER_SIZE                4096
-#define ISO_BUFFER_SIZE             (64 * KB)	// Buffer size used for ISO data extraction
+#define ISO_BUFFER_SIZE             (1 * MB)	// Buffer size used for ISO data extraction
 #define RSA_SIGNATURE_SIZE          256
 #define CBN_SELCHANGE_INTERNAL      (CBN_SELCHANGE + 256)
 #if defined(RUFUS_TEST)
@@ -220,6 +220,7 @@ static __inline void static_repchr(char* p, char s, char r) {
 extern void uprintf(const char *format, ...);
 extern void uprintfs(const char *str);
 extern void wuprintf(const wchar_t* format, ...);
+extern void uflush(void);
 extern void uprint_progress(uint64_t cur_value, uint64_t max_value);
 #define vuprintf(...) do { if (verbose) uprintf(__VA_ARGS__); } while(0)
 #define vvuprintf(...) do { if (verbose > 1) uprintf(__VA_ARGS__); } while(0)
@@ -278,7 +279,8 @@ enum timer_type {
 	TID_APP_TIMER,
 	TID_BLOCKING_TIMER,
 	TID_REFRESH_TIMER,
-	TID_MARQUEE_TIMER
+	TID_MARQUEE_TIMER,
+	TID_LOG_TIMER
 };
 
 /* Action type, for progress bar breakdown */
@@ -576,6 +578,21 @@ typedef struct {
 	uint8_t thumbprint[SHA1_HASHSIZE];
 } cert_info_t;
 
+/* UEFI bootloader revocation check */
+typedef struct {
+	const char* path;				// path of the bootloader in the image
+	uint8_t* buf;					// bootloader data
+	uint32_t len;					// size of the bootloader data
+	int cert_status;				// result from GetIssuerCertificateInfo()
+	const char* cert_error;			// GetIssuerCertificateInfo() error, if any
+	DWORD cert_error_code;			// error code for the above, or 0
+	cert_info_t cert;				// signer/issuer info
+	BOOL hashed;					// TRUE if the PE256 hash was computed
+	uint8_t hash[SHA256_HASHSIZE];	// PE256 hash
+	BOOL sb_signed;					// signed by a Secure Boot authority
+	int revoked;					// revocation type, 0 if not revoked, <0 on error
+} bootloader_check_t;
+
 /* Hash functions */
 typedef void hash_init_t(HASH_CONTEXT* ctx);
 typedef void hash_write_t(HASH_CONTEXT* ctx, const uint8_t* buf, size_t len);
@@ -729,6 +746,7 @@ typedef struct htab_table {
 extern BOOL htab_create(uint32_t nel, htab_table* htab);
 extern void htab_destroy(htab_table* htab);
 extern uint32_t htab_hash(char* str, htab_table* htab);
+extern uint32_t htab_lookup(char* str, htab_table* htab);
 
 /* Basic String Array */
 typedef struct {
@@ -744,6 +762,19 @@ extern void StrArrayClear(StrArray* arr);
 extern void StrArrayDestroy(StrArray* arr);
 #define IsStrArrayEmpty(arr) (arr.Index == 0)
 
+/* In-memory config file, for multiple edits with a single read and write */
+typedef struct {
+	char* path;
+	wchar_t* wpath;
+	wchar_t** line;		// Lines, including their EOL
+	size_t* start;		// Offset of the first non whitespace character of each line
+	size_t max_len;		// Length of the longest line
+	uint32_t nb_lines;
+	uint32_t max_lines;
+	int mode;			// 0 = ANSI, 1 = UTF-8 with BOM, 2 = UTF-16LE
+	BOOL modified;
+} config_doc;
+
 // Options for the custom selection dialog
 #define SELECTION_NEEDS_ALL_TO_PROCEED 1
 #define SELECTION_USE_WARNING_ICON     2
@@ -844,6 +875,7 @@ extern BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan);
 extern BOOL ExtractZip(const char* src_zip, const char* dest_dir);
 extern int64_t ExtractISOFile(const char* iso, const char* iso_file, const char* dest_file, DWORD attributes);
 extern uint32_t ReadISOFileToBuffer(const char* iso, const char* iso_file, uint8_t** buf);
+extern uint32_t ReadISOFilesToBuffers(const char* iso, uint32_t count, const char** iso_file, uint8_t** buf, uint32_t* len);
 extern BOOL HasEfiImgBootLoaders(void* iso);
 extern BOOL DumpFatDir(void* iso, const char* path, int32_t cluster);
 extern BOOL InstallSyslinux(DWORD drive_index, char drive_letter, int fs);
@@ -876,6 +908,12 @@ extern BOOL IsDownloadable(const char* url);
 extern BOOL IsShown(HWND hDlg);
 extern uint32_t read_file(const char* path, uint8_t** buf);
 extern uint32_t write_file(const char* path, const uint8_t* buf, const uint32_t size);
+extern config_doc* open_config_doc(const char* filename);
+extern BOOL close_config_doc(config_doc* doc, BOOL dos2unix);
+extern char* get_token_data_doc_indexed(config_doc* doc, const char* token, int index);
+extern char* set_token_data_doc(config_doc* doc, const char* token, const char* data);
+extern char* insert_section_data_doc(config_doc* doc, const char* section, const char* data);
+extern char* replace_in_token_data_doc(config_doc* doc, const char* token, const char* src, const char* rep);
 extern char* get_token_data_file_indexed(const char* token, const char* filename, int index);
 #define get_token_data_file(token, filename) get_token_data_file_indexed(token, filename, 1)
 extern char* set_token_data_file(const char* token, const char* data, const char* filename);
@@ -891,7 +929,8 @@ extern void* get_data_from_asn1(const uint8_t* buf, size_t buf_len, const char*
 extern int sanitize_label(char* label);
 extern int IsHDD(DWORD DriveIndex, uint16_t vid, uint16_t pid, const char* strid);
 extern char* GetSignatureName(const char* path, const char* country_code, uint8_t* thumbprint, BOOL bSilent);
-extern int GetIssuerCertificateInfo(uint8_t* cert, cert_info_t* info);
+extern const char* WinPKIErrorString(void);
+extern int GetIssuerCertificateInfo(uint8_t* cert, cert_info_t* info, const char** error, DWORD* error_code);
 extern uint64_t GetSignatureTimeStamp(const char* path);
 extern LONG ValidateSignature(HWND hDlg, const char* path);
 extern BOOL ValidateOpensslSignature(BYTE* pbBuffer, DWORD dwBufferLen, BYTE* pbSignature, DWORD dwSigLen);
@@ -906,14 +945,15 @@ extern BOOL DetectSHA1Acceleration(void);
 extern BOOL DetectSHA256Acceleration(void);
 extern BOOL HashFile(const unsigned type, const char* path, uint8_t* sum);
 extern BOOL PE256Buffer(uint8_t* buf, uint32_t len, uint8_t* hash);
+extern uint32_t ParseMD5Sum(char* md5_data, htab_table* htab);
 extern void UpdateMD5Sum(const char* dest_dir, const char* md5sum_name);
 extern BOOL HashBuffer(const unsigned type, const uint8_t* buf, const size_t len, uint8_t* sum);
 extern uint8_t* StringToHash(const char* str);
 extern BOOL FileMatchesHash(const char* path, const char* str);
 extern BOOL BufferMatchesHash(const uint8_t* buf, const size_t len, const char* str);
 extern BOOL IsFileInDB(const char* path);
-extern BOOL IsSignedBySecureBootAuthority(uint8_t* buf, uint32_t len);
-extern int IsBootloaderRevoked(uint8_t* buf, uint32_t len);
+extern void CheckBootloaders(bootloader_check_t* bl, uint32_t count);
+extern void FreeDbx(void);
 extern BOOL IsBufferInDB(const unsigned char* buf, const size_t len);
 #define printbits(x) _printbits(sizeof(x), &x, 0)
 #define printbitslz(x) _printbits(sizeof(x), &x, 1)
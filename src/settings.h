@@ -60,6 +60,8 @@ extern char* ini_file;
 #define SETTING_PREFERRED_SAVE_IMAGE_TYPE   "PreferredSaveImageType"
 #define SETTING_PRESERVE_TIMESTAMPS         "PreserveTimestamps"
 #define SETTING_VERBOSE_UPDATES             "VerboseUpdateCheck"
+#define SETTING_WRITE_TUNING_DEVICE         "WriteTuningDevice"
+#define SETTING_WRITE_TUNING_SIZE           "WriteTuningSize"
 #define SETTING_WUE_OPTIONS                 "WindowsUserExperienceOptions"
 
 
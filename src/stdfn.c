@@ -133,8 +133,9 @@ void htab_destroy(htab_table* htab)
  * The used field can be used as a first fast comparison for equality of
  * the stored and the parameter value. This helps to prevent unnecessary
  * expensive calls of strcmp.
+ * If add is FALSE, strings that are not found are not added to the table.
  */
-uint32_t htab_hash(char* str, htab_table* htab)
+static uint32_t htab_search(char* str, htab_table* htab, BOOL add)
 {
 	uint32_t hval, hval2;
 	uint32_t idx;
@@ -195,6 +196,9 @@ uint32_t htab_hash(char* str, htab_table* htab)
 		while (htab->table[idx].used);
 	}
 
+	if (!add)
+		return 0;
+
 	// Not found => New entry
 
 	// If the table is full return an error
@@ -216,6 +220,22 @@ uint32_t htab_hash(char* str, htab_table* htab)
 	return idx;
 }
 
+/*
+ * Return the index of str, adding it to the table if it doesn't exist.
+ */
+uint32_t htab_hash(char* str, htab_table* htab)
+{
+	return htab_search(str, htab, TRUE);
+}
+
+/*
+ * Return the index of str, or 0 if it doesn't exist in the table.
+ */
+uint32_t htab_lookup(char* str, htab_table* htab)
+{
+	return htab_search(str, htab, FALSE);
+}
+
 const char* GetEditionName(DWORD ProductType)
 {
 	static char unknown_edition_str[64] = "";
@@ -793,19 +813,27 @@ DWORD GetResourceSize(HMODULE module, char* name, char* type, const char* desc)
 	return (GetResource(module, name, type, desc, &len, FALSE) == NULL)?0:len;
 }
 
+// Size of the buffer used to read the output of a console command, and maximum
+// size of the incomplete '\r' delimited segment that we carry over between reads
+// so that a progress line split by the pipe can still be matched.
+#define CMD_OUTPUT_BUFFER_SIZE      (16 * KB)
+#define CMD_OUTPUT_CARRY_MAX        256
+
 // Run a console command, with optional redirection of stdout and stderr to our log
 // as well as optional progress reporting if msg is not 0.
 DWORD RunCommandWithProgress(const char* cmd, const char* dir, BOOL log, int msg, const char* pattern)
 {
-	DWORD ret, dwRead, dwAvail, dwPipeSize = 4096;
+	DWORD ret, dwRead, dwAvail, dwPipeSize = 4096, carry = 0, len;
 	STARTUPINFOA si = { 0 };
 	PROCESS_INFORMATION pi = { 0 };
 	SECURITY_ATTRIBUTES sa = { sizeof(SECURITY_ATTRIBUTES), NULL, TRUE };
 	HANDLE hOutputRead = INVALID_HANDLE_VALUE, hOutputWrite = INVALID_HANDLE_VALUE;
-	static char *output, *p;
+	char *output = NULL, *data, *p;
 	cregex_node_t* node = NULL;
 	cregex_program_t* program = NULL;
 	char* matches[REGEX_VM_MAX_MATCHES];
+	uint64_t progress, last_progress = UINT64_MAX;
+	float f;
 
 	si.cb = sizeof(si);
 	if (msg != 0 || log) {
@@ -816,6 +844,12 @@ DWORD RunCommandWithProgress(const char* cmd, const char* dir, BOOL log, int msg
 			uprintf("Could not set commandline pipe: %s", WindowsErrorString());
 			goto out;
 		}
+		output = malloc(CMD_OUTPUT_BUFFER_SIZE + 1);
+		if (output == NULL) {
+			ret = ERROR_NOT_ENOUGH_MEMORY;
+			uprintf("Could not allocate commandline buffer");
+			goto out;
+		}
 		si.dwFlags = STARTF_USESHOWWINDOW | STARTF_USESTDHANDLES | STARTF_PREVENTPINNING | STARTF_TITLEISAPPID;
 		si.wShowWindow = SW_HIDE;
 		si.hStdOutput = hOutputWrite;
@@ -861,35 +895,53 @@ DWORD RunCommandWithProgress(const char* cmd, const char* dir, BOOL log, int msg
 				ret = ERROR_CANCELLED;
 				goto out;
 			}
+			// Only the newly read data is scanned for progress, along with the
+			// incomplete segment carried over from the previous read, so that the
+			// cost of parsing remains proportional to the size of the output.
+			dwRead = 0;
 			// coverity[string_null]
-			if (PeekNamedPipe(hOutputRead, NULL, dwPipeSize, NULL, &dwAvail, NULL)) {
-				if (dwAvail != 0) {
-					output = malloc(dwAvail + 1);
-					if ((output != NULL) && (ReadFile(hOutputRead, output, dwAvail, &dwRead, NULL)) && (dwRead != 0)) {
-						output[dwAvail] = 0;
-						// Process a commandline progress into a percentage
-						if (program != NULL && cregex_program_run(program, output, (const char**)matches, ARRAYSIZE(matches)) > 0 &&
-							matches[2] != NULL && matches[3] != NULL) {
-							// matches[2] is for the first group
-							// matches[3] is for the end of the first group
-							matches[3][0] = '\0';
-							float f = 0.0f;
-							IGNORE_RETVAL(sscanf(matches[2], "%f", &f));
-							UpdateProgressWithInfo(OP_FORMAT, msg, (uint64_t)(f * 100.0f), 100 * 100ULL);
-						} else if (log) {
+			if (PeekNamedPipe(hOutputRead, NULL, 0, NULL, &dwAvail, NULL) && (dwAvail != 0)) {
+				data = &output[carry];
+				if (ReadFile(hOutputRead, data, MIN(dwAvail, CMD_OUTPUT_BUFFER_SIZE - carry), &dwRead, NULL) && (dwRead != 0)) {
+					data[dwRead] = 0;
+					len = carry + dwRead;
+					// Process a commandline progress into a percentage
+					if (program != NULL && cregex_program_run(program, output, (const char**)matches, ARRAYSIZE(matches)) > 0 &&
+						matches[2] != NULL && matches[3] != NULL) {
+						// matches[2] is for the first group
+						// matches[3] is for the end of the first group
+						f = 0.0f;
+						IGNORE_RETVAL(sscanf(matches[2], "%f", &f));
+						progress = (uint64_t)(f * 100.0f);
+						// Some commands repeat their progress, so only report actual changes
+						if (progress != last_progress)
+							UpdateProgressWithInfo(OP_FORMAT, msg, progress, 100 * 100ULL);
+						last_progress = progress;
+						// Don't carry over the data we just matched
+						p = strrchr(matches[3], '\r');
+					} else {
+						if (log) {
 							// output may contain a '%' so don't feed it as a naked format string
-							uprintf("%s", output);
-						} else if ((p = strstr(output, "ERROR:")) != NULL) {
+							uprintf("%s", data);
+						} else if ((p = strstr(data, "ERROR:")) != NULL) {
 							// Mostly for oscdimg.exe errors
 							uprintf("%s", p);
 						}
+						p = strrchr(output, '\r');
 					}
-					free(output);
+					// Keep the last '\r' delimited segment, if it's short enough to be a progress line
+					carry = (p != NULL && len - (DWORD)(p - output) <= CMD_OUTPUT_CARRY_MAX) ? len - (DWORD)(p - output) : 0;
+					if (carry != 0)
+						memmove(output, p, carry);
 				}
 			}
-			if (WaitForSingleObject(pi.hProcess, 0) == WAIT_OBJECT_0)
-				break;
-			Sleep(100);
+			// Don't wait while the command is still producing output, and make sure
+			// that we have read all of it before we exit.
+			if (dwRead == 0) {
+				if (WaitForSingleObject(pi.hProcess, 0) == WAIT_OBJECT_0)
+					break;
+				Sleep(100);
+			}
 		};
 	} else {
 		switch (WaitForSingleObject(pi.hProcess, 1800000)) {
@@ -913,6 +965,7 @@ DWORD RunCommandWithProgress(const char* cmd, const char* dir, BOOL log, int msg
 
 out:
 	cregex_compile_free(program);
+	free(output);
 	safe_closehandle(hOutputWrite);
 	safe_closehandle(hOutputRead);
 	return ret;
@@ -66,9 +66,108 @@ typedef struct {
 } debug_info_t;
 #pragma pack(pop)
 
+/*
+ * Log ring, so that threads other than the UI one don't have to wait for the
+ * latter to add their messages to the log window. This is a bounded lock-free
+ * multiple producers/single consumer queue, where the sequence of each slot
+ * tells whether it is free for the producer that reserved it, or has been
+ * filled and is ready for the consumer.
+ */
+#define LOG_RING_SIZE           4096	// Must be a power of 2
+static struct {
+	volatile LONG seq;
+	wchar_t* str;
+} log_ring[LOG_RING_SIZE];
+static volatile LONG log_ring_head = 0;
+static ULONG log_ring_tail = 0;
+// Sequences are stored relative to the slot index, so that no initialization is needed
+#define LOG_RING_INDEX(pos)     ((size_t)((pos) & (LOG_RING_SIZE - 1)))
+#define LOG_RING_SEQ(pos)       ((ULONG)log_ring[LOG_RING_INDEX(pos)].seq + (ULONG)LOG_RING_INDEX(pos))
+#define LOG_RING_SET_SEQ(pos, val) InterlockedExchange(&log_ring[LOG_RING_INDEX(pos)].seq, (LONG)((val) - (ULONG)LOG_RING_INDEX(pos)))
+
+// Append a message to the log window. The message is freed once displayed.
+static void log_push(wchar_t* wstr)
+{
+	ULONG pos, seq;
+
+	if ((hLog == NULL) || (hLog == INVALID_HANDLE_VALUE) || (wstr == NULL)) {
+		free(wstr);
+		return;
+	}
+
+	// Messages from the UI thread are displayed right away, in order, since
+	// that's the thread that empties the ring
+	if (GetWindowThreadProcessId(hLog, NULL) == GetCurrentThreadId()) {
+		uflush();
+		Edit_SetSel(hLog, MAX_LOG_SIZE, MAX_LOG_SIZE);
+		Edit_ReplaceSel(hLog, wstr);
+		// Make sure the message scrolls into view
+		Edit_Scroll(hLog, Edit_GetLineCount(hLog), 0);
+		free(wstr);
+		return;
+	}
+
+	while (1) {
+		pos = (ULONG)log_ring_head;
+		seq = LOG_RING_SEQ(pos);
+		if (seq == pos) {
+			// Slot is free => try to reserve it
+			if (InterlockedCompareExchange(&log_ring_head, (LONG)(pos + 1), (LONG)pos) == (LONG)pos)
+				break;
+		} else if ((LONG)(seq - pos) < 0) {
+			// Ring is full => wait for the UI thread to catch up
+			Sleep(1);
+		}
+	}
+	log_ring[LOG_RING_INDEX(pos)].str = wstr;
+	LOG_RING_SET_SEQ(pos, pos + 1);
+}
+
+// Add all the pending messages from the log ring to the log window.
+// Must be called from the UI thread.
+void uflush(void)
+{
+	ULONG pos;
+	size_t i, len = 0;
+	wchar_t *wbuf, *p;
+
+	// Compute the size of the batch, as the messages that are ready, in order
+	for (pos = log_ring_tail; LOG_RING_SEQ(pos) == pos + 1; pos++) {
+		// Don't read the message before we know that it is ready
+		MemoryBarrier();
+		len += wcslen(log_ring[LOG_RING_INDEX(pos)].str);
+	}
+	if (pos == log_ring_tail)
+		return;
+
+	p = wbuf = malloc((len + 1) * sizeof(wchar_t));
+	for (; log_ring_tail != pos; log_ring_tail++) {
+		i = LOG_RING_INDEX(log_ring_tail);
+		if (wbuf != NULL) {
+			len = wcslen(log_ring[i].str);
+			memcpy(p, log_ring[i].str, len * sizeof(wchar_t));
+			p += len;
+		}
+		free(log_ring[i].str);
+		log_ring[i].str = NULL;
+		// Release the slot for the next round of producers
+		LOG_RING_SET_SEQ(log_ring_tail, log_ring_tail + LOG_RING_SIZE);
+	}
+	if (wbuf == NULL)
+		return;
+	*p = 0;
+
+	if ((hLog != NULL) && (hLog != INVALID_HANDLE_VALUE)) {
+		Edit_SetSel(hLog, MAX_LOG_SIZE, MAX_LOG_SIZE);
+		Edit_ReplaceSel(hLog, wbuf);
+		Edit_Scroll(hLog, Edit_GetLineCount(hLog), 0);
+	}
+	free(wbuf);
+}
+
 void uprintf(const char *format, ...)
 {
-	static char buf[4096];
+	char buf[4096];
 	char* p = buf;
 	wchar_t* wbuf;
 	va_list args;
@@ -91,19 +190,13 @@ void uprintf(const char *format, ...)
 	// Send output to Windows debug facility
 	// coverity[dont_call]
 	OutputDebugStringW(wbuf);
-	if ((hLog != NULL) && (hLog != INVALID_HANDLE_VALUE)) {
-		// Send output to our log Window
-		Edit_SetSel(hLog, MAX_LOG_SIZE, MAX_LOG_SIZE);
-		Edit_ReplaceSel(hLog, wbuf);
-		// Make sure the message scrolls into view
-		Edit_Scroll(hLog, Edit_GetLineCount(hLog), 0);
-	}
-	free(wbuf);
+	// Send output to our log Window
+	log_push(wbuf);
 }
 
 void wuprintf(const wchar_t* format, ...)
 {
-	static wchar_t wbuf[4096];
+	wchar_t wbuf[4096];
 	wchar_t* p = wbuf;
 	va_list args;
 	int n;
@@ -122,11 +215,7 @@ void wuprintf(const wchar_t* format, ...)
 
 	// coverity[dont_call]
 	OutputDebugStringW(wbuf);
-	if ((hLog != NULL) && (hLog != INVALID_HANDLE_VALUE)) {
-		Edit_SetSel(hLog, MAX_LOG_SIZE, MAX_LOG_SIZE);
-		Edit_ReplaceSel(hLog, wbuf);
-		Edit_Scroll(hLog, Edit_GetLineCount(hLog), 0);
-	}
+	log_push(_wcsdup(wbuf));
 }
 
 void uprintfs(const char* str)
@@ -135,12 +224,7 @@ void uprintfs(const char* str)
 	wstr = utf8_to_wchar(str);
 	// coverity[dont_call]
 	OutputDebugStringW(wstr);
-	if ((hLog != NULL) && (hLog != INVALID_HANDLE_VALUE)) {
-		Edit_SetSel(hLog, MAX_LOG_SIZE, MAX_LOG_SIZE);
-		Edit_ReplaceSel(hLog, wstr);
-		Edit_Scroll(hLog, Edit_GetLineCount(hLog), 0);
-	}
-	free(wstr);
+	log_push(wstr);
 }
 
 void uprint_progress(uint64_t cur_value, uint64_t max_value)
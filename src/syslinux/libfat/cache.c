@@ -17,6 +17,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <malloc.h>
 #include "libfatint.h"
 
@@ -27,48 +28,163 @@
  * For good measure, we'll go further and align our buffers on a 16-byte boundary.
  * Also, since struct libfat_sector's data[0] is our buffer, this means we must BOTH
  * align that member in the struct declaration, and use aligned malloc/free.
+ *
+ * The cache entries are carved out of a single aligned slab, allocated on first use,
+ * and are kept both in a hash table, for lookup, and in a circular LRU list, so that
+ * the least recently used entry can be recycled when a sector is not in the cache.
  */
-void *libfat_get_sector(struct libfat_filesystem *fs, libfat_sector_t n)
+#define LIBFAT_ENTRY_SIZE	(sizeof(struct libfat_sector) + LIBFAT_SECTOR_SIZE)
+#define LIBFAT_HASH(n)		((uint32_t)(n) & (LIBFAT_CACHE_BUCKETS - 1))
+
+static struct libfat_sector *libfat_entry(struct libfat_filesystem *fs, int i)
+{
+    return (struct libfat_sector *)((char *)fs->sectors + i * LIBFAT_ENTRY_SIZE);
+}
+
+static int libfat_init_cache(struct libfat_filesystem *fs)
 {
     struct libfat_sector *ls;
+    int i;
+
+    fs->sectors = _mm_malloc(LIBFAT_CACHE_SECTORS * LIBFAT_ENTRY_SIZE, 16);
+    fs->readbuf = _mm_malloc(LIBFAT_READAHEAD * LIBFAT_SECTOR_SIZE, 16);
+    if (!fs->sectors || !fs->readbuf) {
+	libfat_flush(fs);
+	return -1;
+    }
+
+    /* All entries start out unused, at the tail of the LRU list */
+    for (i = 0; i < LIBFAT_CACHE_SECTORS; i++) {
+	ls = libfat_entry(fs, i);
+	ls->n = (libfat_sector_t)-1;
+	ls->next = NULL;
+	ls->prev_lru = libfat_entry(fs, (i + LIBFAT_CACHE_SECTORS - 1) % LIBFAT_CACHE_SECTORS);
+	ls->next_lru = libfat_entry(fs, (i + 1) % LIBFAT_CACHE_SECTORS);
+    }
+    fs->lru = libfat_entry(fs, 0);
+    memset(fs->hash, 0, sizeof(fs->hash));
+    return 0;
+}
 
-    for (ls = fs->sectors; ls; ls = ls->next) {
+/* Make an entry the most recently used one */
+static void libfat_touch(struct libfat_filesystem *fs, struct libfat_sector *ls)
+{
+    if (ls == fs->lru)
+	return;
+    ls->prev_lru->next_lru = ls->next_lru;
+    ls->next_lru->prev_lru = ls->prev_lru;
+    ls->next_lru = fs->lru;
+    ls->prev_lru = fs->lru->prev_lru;
+    ls->prev_lru->next_lru = ls;
+    fs->lru->prev_lru = ls;
+    fs->lru = ls;
+}
+
+static struct libfat_sector *libfat_lookup(struct libfat_filesystem *fs,
+					   libfat_sector_t n)
+{
+    struct libfat_sector *ls;
+
+    for (ls = fs->hash[LIBFAT_HASH(n)]; ls; ls = ls->next) {
 	if (ls->n == n)
-	    return ls->data;	/* Found in cache */
+	    return ls;
     }
+    return NULL;
+}
 
-    /* Not found in cache */
-    ls = _mm_malloc(sizeof(struct libfat_sector) + LIBFAT_SECTOR_SIZE, 16);
-    if (!ls) {
-	libfat_flush(fs);
-	ls = _mm_malloc(sizeof(struct libfat_sector) + LIBFAT_SECTOR_SIZE, 16);
+/* Recycle the least recently used entry to hold sector n */
+static struct libfat_sector *libfat_recycle(struct libfat_filesystem *fs,
+					    libfat_sector_t n)
+{
+    struct libfat_sector *ls = fs->lru->prev_lru, **lsp;
 
-	if (!ls)
-	    return NULL;	/* Can't allocate memory */
+    if (ls->n != (libfat_sector_t)-1) {
+	for (lsp = &fs->hash[LIBFAT_HASH(ls->n)]; *lsp != ls; lsp = &(*lsp)->next);
+	*lsp = ls->next;
     }
+    ls->n = n;
+    ls->next = fs->hash[LIBFAT_HASH(n)];
+    fs->hash[LIBFAT_HASH(n)] = ls;
+    libfat_touch(fs, ls);
+    return ls;
+}
+
+/*
+ * Number of sectors to read when sector n is not cached: FAT, root directory
+ * and cluster chains are mostly walked forward, so read ahead to the end of
+ * the current cluster, or of the current FAT or root directory region.
+ */
+static int libfat_readahead(struct libfat_filesystem *fs, libfat_sector_t n)
+{
+    libfat_sector_t end;
+    int i, count;
+
+    if (fs->end == 0)		/* Filesystem not opened yet */
+	return 1;
+    if (n >= fs->data)
+	end = n + fs->clustsize - ((n - fs->data) & (fs->clustsize - 1));
+    else if (n >= fs->rootdir)
+	end = fs->data;
+    else if (n >= fs->fat)
+	end = fs->rootdir;
+    else
+	return 1;
+    if (end > fs->end)
+	end = fs->end;
+    if (end <= n)
+	return 1;
+    count = (end - n > LIBFAT_READAHEAD) ? LIBFAT_READAHEAD : (int)(end - n);
 
-    if (fs->read(fs->readptr, ls->data, LIBFAT_SECTOR_SIZE, n)
-	!= LIBFAT_SECTOR_SIZE) {
-	_mm_free(ls);
-	return NULL;		/* I/O error */
+    /* Don't read again what is already in the cache */
+    for (i = 1; i < count; i++) {
+	if (libfat_lookup(fs, n + i))
+	    break;
     }
+    return i;
+}
 
-    ls->n = n;
-    ls->next = fs->sectors;
-    fs->sectors = ls;
+void *libfat_get_sector(struct libfat_filesystem *fs, libfat_sector_t n)
+{
+    struct libfat_sector *ls;
+    int i, count;
+
+    ls = libfat_lookup(fs, n);
+    if (ls) {
+	libfat_touch(fs, ls);
+	return ls->data;	/* Found in cache */
+    }
+
+    /* Not found in cache */
+    if (!fs->sectors && libfat_init_cache(fs))
+	return NULL;		/* Can't allocate memory */
+
+    count = libfat_readahead(fs, n);
+    if (fs->read(fs->readptr, fs->readbuf, count * LIBFAT_SECTOR_SIZE, n)
+	!= (int)(count * LIBFAT_SECTOR_SIZE)) {
+	/* Don't fail on a read-ahead that went past something unreadable */
+	count = 1;
+	if (fs->read(fs->readptr, fs->readbuf, LIBFAT_SECTOR_SIZE, n)
+	    != LIBFAT_SECTOR_SIZE)
+	    return NULL;	/* I/O error */
+    }
+
+    /* Insert the requested sector last, so that it is the most recently used */
+    for (i = count - 1; i >= 0; i--) {
+	ls = libfat_recycle(fs, n + i);
+	memcpy(ls->data, &fs->readbuf[i * LIBFAT_SECTOR_SIZE], LIBFAT_SECTOR_SIZE);
+    }
 
     return ls->data;
 }
 
 void libfat_flush(struct libfat_filesystem *fs)
 {
-    struct libfat_sector *ls, *lsnext;
-
-    lsnext = fs->sectors;
+    if (fs->sectors)
+	_mm_free(fs->sectors);
+    if (fs->readbuf)
+	_mm_free(fs->readbuf);
     fs->sectors = NULL;
-
-    for (ls = lsnext; ls; ls = lsnext) {
-	lsnext = ls->next;
-	_mm_free(ls);
-    }
+    fs->readbuf = NULL;
+    fs->lru = NULL;
+    memset(fs->hash, 0, sizeof(fs->hash));
 }
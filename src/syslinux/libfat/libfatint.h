@@ -30,9 +30,20 @@
 #define ALIGN_END(m)
 #endif
 
+/*
+ * Sector cache parameters: number of cached sectors, number of hash
+ * buckets (must be a power of 2) and maximum number of sectors read
+ * at once when reading ahead.
+ */
+#define LIBFAT_CACHE_SECTORS	512
+#define LIBFAT_CACHE_BUCKETS	512
+#define LIBFAT_READAHEAD	8
+
 ALIGN_START(16) struct libfat_sector {
 	libfat_sector_t n;		/* Sector number */
-	struct libfat_sector *next;	/* Next in list */
+	struct libfat_sector *next;	/* Next in hash bucket */
+	struct libfat_sector *prev_lru;	/* More recently used */
+	struct libfat_sector *next_lru;	/* Less recently used */
 	/* data[0] MUST be aligned to at least 8 bytes - see cache.c */
 	ALIGN_START(16) char data[0] ALIGN_END(16);
 } ALIGN_END(16);
@@ -58,7 +69,10 @@ struct libfat_filesystem {
     libfat_sector_t data;	/* Start of data area */
     libfat_sector_t end;	/* End of filesystem */
 
-    struct libfat_sector *sectors;
+    struct libfat_sector *sectors;	/* Slab of cache entries */
+    struct libfat_sector *lru;		/* Most recently used entry */
+    struct libfat_sector *hash[LIBFAT_CACHE_BUCKETS];
+    char *readbuf;			/* Multi-sector read buffer */
 };
 
 #endif /* LIBFATINT_H */
@@ -31,11 +31,11 @@ libfat_open(int (*readfunc) (intptr_t, void *, size_t, libfat_sector_t),
     uint32_t sectors, fatsize, minfatsize, rootdirsize;
     uint32_t nclusters;
 
-    fs = malloc(sizeof(struct libfat_filesystem));
+    /* Zeroed, so that the sector cache is empty and read-ahead disabled */
+    fs = calloc(1, sizeof(struct libfat_filesystem));
     if (!fs)
 	goto barf;
 
-    fs->sectors = NULL;
     fs->read = readfunc;
     fs->readptr = readptr;
 
@@ -106,7 +106,7 @@ libfat_open(int (*readfunc) (intptr_t, void *, size_t, libfat_sector_t),
 
 barf:
     if (fs)
-	free(fs);
+	libfat_close(fs);
     return NULL;
 }
 
@@ -1441,8 +1441,14 @@ void _UpdateProgressWithInfo(int op, int msg, uint64_t processed, uint64_t total
 			SendMessage(hProgressDialog, UM_PROGRESS_INIT, 0, 0);
 		}
 	} else if ((hProgressBar != NULL) || (op > 0)) {
-		uint64_t dl_total_time = current_time - start_time;
-		uint64_t howmuch = processed - bp.count;
+		uint64_t dl_total_time, howmuch;
+		// This is called from the copy loops on every single chunk, so, unless we have to refresh
+		// the UI, return early. The bytes processed in between are picked up on the next refresh,
+		// since the speed history only works with the delta against the last recorded count.
+		if ((!force) && (processed < total) && (current_time <= last_refresh + MAX_REFRESH))
+			return;
+		dl_total_time = current_time - start_time;
+		howmuch = processed - bp.count;
 		bp.count = processed;
 		bp.total_length = total;
 		if (bp.count > bp.total_length)
@@ -287,7 +287,7 @@ uint32_t GetWimVersion(const char* image)
 	if (image == NULL)
 		return 0;
 
-	r = wimlib_open_wimU(image, 0, &wim);
+	r = wimlib_open_wimU(image, WIMLIB_OPEN_FLAG_XML_ONLY, &wim);
 	if (r == 0) {
 		r = wimlib_get_wim_info(wim, &info);
 		wimlib_free(wim);
@@ -40,126 +40,114 @@
 #endif
 
 #ifdef WITH_LIBCDIO
-static int
-udf_pread(struct filedes* fd, void* buf, size_t count, off_t offset)
-{
-	ssize_t ret;
-	size_t partial_size;
-	uint64_t file_length;
-	char _buf[UDF_BLOCKSIZE];
-
-	if (count == 0)
-		return 0;
-
-	if (!udf_setpos(fd->p_udf_file, (offset / UDF_BLOCKSIZE) * UDF_BLOCKSIZE)) {
-		errno = ERANGE;
-		return WIMLIB_ERR_READ;
-	}
-	fd->offset = (offset / UDF_BLOCKSIZE) * UDF_BLOCKSIZE;
+/*
+ * WIMs that reside inside an ISO image are read through libcdio, which has no
+ * caching of its own and can only read whole 2 KB blocks. So, rather than issue
+ * one or more block reads for each of the (small and mostly sequential) chunk
+ * reads wimlib performs, we serve these from a per-filedes cache, that we fill
+ * using a read-ahead window that doubles on sequential access. Block aligned
+ * requests that are at least as large as the window bypass the cache.
+ */
+#define CDIO_READ_AHEAD_MIN	(64 * 1024)
+#define CDIO_READ_AHEAD_MAX	(4 * 1024 * 1024)
 
-	file_length = udf_get_file_length(fd->p_udf_file);
-	if (offset + count > file_length)
-		count = file_length - offset;
+/* UDF_BLOCKSIZE and ISO_BLOCKSIZE are the same, so we use the latter for both */
+static ssize_t
+cdio_read_blocks(struct filedes* fd, void* buf, u64 offset, size_t count)
+{
+	ssize_t ret, total = 0;
 
-	if (offset % UDF_BLOCKSIZE) {
-		partial_size = min(UDF_BLOCKSIZE - offset % UDF_BLOCKSIZE, count);
-		ret = udf_read_block(fd->p_udf_file, _buf, 1);
-		if (unlikely(ret <= 0)) {
-			errno = EINVAL;
-			return WIMLIB_ERR_READ;
-		}
-		memcpy(buf, &_buf[offset % UDF_BLOCKSIZE], partial_size);
-		buf = _PTR(buf + partial_size);
-		fd->offset += partial_size;
-		count -= partial_size;
-	}
+	if (fd->is_iso)
+		return iso9660_iso_seek_read(fd->p_iso, buf, fd->p_iso_file->lsn +
+			(lsn_t)(offset / ISO_BLOCKSIZE), (long)(count / ISO_BLOCKSIZE));
 
-	while (count >= UDF_BLOCKSIZE) {
-		ret = udf_read_block(fd->p_udf_file, buf, count / UDF_BLOCKSIZE);
-		if (unlikely(ret <= 0)) {
-			errno = EINVAL;
-			return WIMLIB_ERR_READ;
-		}
+	if (!udf_setpos(fd->p_udf_file, offset))
+		return -1;
+	/* Reads that cross an extent boundary get truncated by libcdio */
+	while (count > 0) {
+		ret = udf_read_block(fd->p_udf_file, buf, count / ISO_BLOCKSIZE);
+		if (ret <= 0)
+			return (total != 0) ? total : -1;
+		total += ret;
+		/* A partial block means we reached the end of the file */
+		if (ret % ISO_BLOCKSIZE != 0)
+			break;
 		buf = _PTR(buf + ret);
-		fd->offset += ret;
 		count -= ret;
 	}
-
-	partial_size = count % UDF_BLOCKSIZE;
-	if (partial_size) {
-		ret = udf_read_block(fd->p_udf_file, _buf, 1);
-		if (unlikely(ret <= 0)) {
-			errno = EINVAL;
-			return WIMLIB_ERR_READ;
-		}
-		memcpy(buf, _buf, partial_size);
-		buf = _PTR(buf + partial_size);
-		fd->offset += partial_size;
-	}
-
-	return 0;
+	return total;
 }
 
 static int
-iso_pread(struct filedes* fd, void* buf, size_t count, off_t offset)
+cdio_pread(struct filedes* fd, void* buf, size_t count, off_t offset)
 {
 	ssize_t ret;
-	size_t partial_size;
-	char _buf[ISO_BLOCKSIZE];
-	lsn_t lsn_offset = fd->p_iso_file->lsn + offset / ISO_BLOCKSIZE;
+	size_t size;
+	u64 aligned, file_length = fd->is_udf ?
+		udf_get_file_length(fd->p_udf_file) : fd->p_iso_file->total_size;
 
 	if (count == 0)
 		return 0;
 
-	if (offset >= fd->p_iso_file->total_size) {
+	if (offset >= file_length) {
 		errno = ERANGE;
 		return WIMLIB_ERR_READ;
 	}
 
-	if (offset + count > fd->p_iso_file->total_size)
-		count = fd->p_iso_file->total_size - offset;
+	if (offset + count > file_length)
+		count = file_length - offset;
 
-	if (offset % ISO_BLOCKSIZE) {
-		partial_size = min(ISO_BLOCKSIZE - offset % ISO_BLOCKSIZE, count);
-		ret = iso9660_iso_seek_read(fd->p_iso, _buf, lsn_offset, 1);
-		if (unlikely(ret <= 0)) {
-			errno = EINVAL;
-			return WIMLIB_ERR_READ;
+	while (count > 0) {
+		/* Serve as much as we can from the cache */
+		if (offset >= fd->cache_start && offset < fd->cache_start + fd->cache_size) {
+			size = min(count, fd->cache_start + fd->cache_size - offset);
+			memcpy(buf, &fd->cache[offset - fd->cache_start], size);
+			buf = _PTR(buf + size);
+			offset += size;
+			count -= size;
+			continue;
 		}
-		lsn_offset += 1;
-		memcpy(buf, &_buf[offset % ISO_BLOCKSIZE], partial_size);
-		buf = _PTR(buf + partial_size);
-		fd->offset += partial_size;
-		count -= partial_size;
-	}
 
-	while (count >= ISO_BLOCKSIZE) {
-		ret = iso9660_iso_seek_read(fd->p_iso, _buf,
-			lsn_offset % ISO_BLOCKSIZE, 1);
-		ret = iso9660_iso_seek_read(fd->p_iso, buf, lsn_offset, count / ISO_BLOCKSIZE);
-		if (unlikely(ret <= 0)) {
-			errno = EINVAL;
-			return WIMLIB_ERR_READ;
+		aligned = offset & ~((u64)ISO_BLOCKSIZE - 1);
+		if ((fd->read_ahead != 0) && (aligned == fd->read_ahead_next))
+			fd->read_ahead = min(fd->read_ahead * 2, CDIO_READ_AHEAD_MAX);
+		else
+			fd->read_ahead = CDIO_READ_AHEAD_MIN;
+
+		if (offset == aligned && count >= fd->read_ahead) {
+			size = count & ~((size_t)ISO_BLOCKSIZE - 1);
+			ret = cdio_read_blocks(fd, buf, aligned, size);
+			if (unlikely(ret <= 0))
+				goto read_error;
+			size = min((size_t)ret, count);
+			buf = _PTR(buf + size);
+			offset += size;
+			count -= size;
+			fd->read_ahead_next = offset;
+			continue;
 		}
-		lsn_offset += ret / ISO_BLOCKSIZE;
-		buf = _PTR(buf + ret);
-		fd->offset += ret;
-		count -= ret;
-	}
 
-	partial_size = count % ISO_BLOCKSIZE;
-	if (partial_size) {
-		ret = iso9660_iso_seek_read(fd->p_iso, _buf, lsn_offset, 1);
-		if (unlikely(ret <= 0)) {
-			errno = EINVAL;
-			return WIMLIB_ERR_READ;
+		if (fd->cache == NULL) {
+			fd->cache = MALLOC(CDIO_READ_AHEAD_MAX);
+			if (fd->cache == NULL)
+				return WIMLIB_ERR_NOMEM;
 		}
-		memcpy(buf, _buf, partial_size);
-		buf = _PTR(buf + partial_size);
-		fd->offset += partial_size;
+		size = (size_t)min(fd->read_ahead, ALIGN(file_length, ISO_BLOCKSIZE) - aligned);
+		fd->cache_size = 0;
+		ret = cdio_read_blocks(fd, fd->cache, aligned, size);
+		if (unlikely(ret <= (ssize_t)(offset - aligned)))
+			goto read_error;
+		fd->cache_start = aligned;
+		fd->cache_size = ret;
+		fd->read_ahead_next = aligned + ret;
 	}
 
+	fd->offset = offset;
 	return 0;
+
+read_error:
+	errno = EINVAL;
+	return WIMLIB_ERR_READ;
 }
 #endif
 
@@ -176,10 +164,8 @@ int
 full_read(struct filedes *fd, void *buf, size_t count)
 {
 #ifdef WITH_LIBCDIO
-	if (fd->is_udf)
-		return udf_pread(fd, buf, count, 0);
-	else if (fd->is_iso)
-		return iso_pread(fd, buf, count, 0);
+	if (fd->is_udf || fd->is_iso)
+		return cdio_pread(fd, buf, count, fd->offset);
 #endif
 
 	while (count) {
@@ -250,10 +236,8 @@ full_pread(struct filedes *fd, void *buf, size_t count, off_t offset)
 		goto is_pipe;
 
 #ifdef WITH_LIBCDIO
-	if (fd->is_udf)
-		return udf_pread(fd, buf, count, offset);
-	else if (fd->is_iso)
-		return iso_pread(fd, buf, count, offset);
+	if (fd->is_udf || fd->is_iso)
+		return cdio_pread(fd, buf, count, offset);
 #endif
 
 	while (count) {
@@ -35,6 +35,8 @@
 #include "wimlib/progress.h"
 #include "wimlib/resource.h"
 #include "wimlib/sha1.h"
+#include "wimlib/threads.h"
+#include "wimlib/util.h"
 #include "wimlib/wim.h"
 #include "wimlib/write.h"
 
@@ -47,6 +49,11 @@
 #define INTEGRITY_MIN_CHUNK_SIZE 4096
 #define INTEGRITY_MAX_CHUNK_SIZE 134217728
 
+/* Maximum number of threads used to checksum chunks concurrently, and maximum
+ * number of bytes of chunk data that may be buffered for them at any time. */
+#define INTEGRITY_MAX_THREADS 4
+#define INTEGRITY_MAX_BUFFERED_BYTES 67108864
+
 PRAGMA_BEGIN_PACKED
 struct integrity_table {
 	u32 size;
@@ -86,6 +93,246 @@ calculate_chunk_sha1(struct filedes *in_fd, size_t this_chunk_size,
 	return 0;
 }
 
+/* State shared by calculate_integrity_table() and verify_integrity() while
+ * checksumming the chunks of a WIM file.  */
+struct integrity_ctx {
+	struct filedes *in_fd;
+	u64 check_bytes;
+	size_t chunk_size;
+
+	/* Table into which the calculated message digests are written, or NULL
+	 * if they are instead checked against @table_to_verify.  */
+	struct integrity_table *new_table;
+	const struct integrity_table *table_to_verify;
+
+	int progress_msg;
+	union wimlib_progress_info progress;
+	wimlib_progress_func_t progfunc;
+	void *progctx;
+};
+
+static inline u64
+integrity_chunk_offset(const struct integrity_ctx *ctx, u32 i)
+{
+	return WIM_HEADER_DISK_SIZE + (u64)i * ctx->chunk_size;
+}
+
+static inline size_t
+integrity_chunk_size(const struct integrity_ctx *ctx, u32 i)
+{
+	return min(ctx->chunk_size,
+		   ctx->check_bytes - (u64)i * ctx->chunk_size);
+}
+
+/* Record or verify the SHA1 message digest of chunk @i, then report progress.
+ * Must be called for each chunk in order.  */
+static int
+integrity_chunk_done(struct integrity_ctx *ctx, u32 i, const u8 sha1_md[])
+{
+	if (ctx->table_to_verify) {
+		if (!hashes_equal(sha1_md, ctx->table_to_verify->sha1sums[i]))
+			return WIM_INTEGRITY_NOT_OK;
+	} else {
+		copy_hash(ctx->new_table->sha1sums[i], sha1_md);
+	}
+	ctx->progress.integrity.completed_chunks++;
+	ctx->progress.integrity.completed_bytes += integrity_chunk_size(ctx, i);
+	return call_progress(ctx->progfunc, ctx->progress_msg,
+			     &ctx->progress, ctx->progctx);
+}
+
+static int
+checksum_chunks_serial(struct integrity_ctx *ctx, u32 first_chunk,
+		       u32 num_chunks)
+{
+	u8 sha1_md[SHA1_HASH_SIZE];
+	int ret;
+
+	for (u32 i = first_chunk; i < num_chunks; i++) {
+		ret = calculate_chunk_sha1(ctx->in_fd,
+					   integrity_chunk_size(ctx, i),
+					   integrity_chunk_offset(ctx, i),
+					   sha1_md);
+		if (ret)
+			return ret;
+		ret = integrity_chunk_done(ctx, i, sha1_md);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* A chunk buffer: filled by the reading thread, then checksummed by one of the
+ * worker threads.  */
+struct integrity_buffer {
+	u8 *data;
+	size_t size;
+	u8 sha1_md[SHA1_HASH_SIZE];
+	bool hashed;
+};
+
+struct integrity_hasher {
+	struct mutex lock;
+	struct condvar chunk_read_cond;
+	struct condvar chunk_hashed_cond;
+	struct integrity_buffer *bufs;
+	unsigned num_bufs;
+	u32 num_read;
+	u32 next_to_hash;
+	bool done_reading;
+};
+
+static void *
+integrity_thread_proc(void *arg)
+{
+	struct integrity_hasher *h = arg;
+	struct integrity_buffer *buf;
+
+	mutex_lock(&h->lock);
+	for (;;) {
+		while (h->next_to_hash == h->num_read && !h->done_reading)
+			condvar_wait(&h->chunk_read_cond, &h->lock);
+		if (h->next_to_hash == h->num_read)
+			break;
+		buf = &h->bufs[h->next_to_hash++ % h->num_bufs];
+		mutex_unlock(&h->lock);
+
+		sha1(buf->data, buf->size, buf->sha1_md);
+
+		mutex_lock(&h->lock);
+		buf->hashed = true;
+		condvar_signal(&h->chunk_hashed_cond);
+	}
+	mutex_unlock(&h->lock);
+	return NULL;
+}
+
+/* Wait for the @n'th chunk submitted to the workers to be checksummed, then
+ * hand its message digest over as chunk @i.  */
+static int
+integrity_wait_chunk(struct integrity_ctx *ctx, struct integrity_hasher *h,
+		     u32 n, u32 i)
+{
+	struct integrity_buffer *buf = &h->bufs[n % h->num_bufs];
+
+	mutex_lock(&h->lock);
+	while (!buf->hashed)
+		condvar_wait(&h->chunk_hashed_cond, &h->lock);
+	buf->hashed = false;
+	mutex_unlock(&h->lock);
+	return integrity_chunk_done(ctx, i, buf->sha1_md);
+}
+
+/*
+ * Checksum chunks [@first_chunk, @num_chunks) of the file.
+ *
+ * The calling thread reads the chunks sequentially, so the file is still
+ * accessed in order, while up to INTEGRITY_MAX_THREADS worker threads compute
+ * the SHA1 message digests of the chunks that have already been read.  Results
+ * are still recorded (or verified) and reported in chunk order.  If the workers
+ * can't be set up, or if there is nothing to gain from them, the chunks are
+ * processed serially instead.
+ */
+static int
+checksum_chunks(struct integrity_ctx *ctx, u32 first_chunk, u32 num_chunks)
+{
+	struct integrity_hasher h = { 0 };
+	struct thread threads[INTEGRITY_MAX_THREADS];
+	unsigned num_threads;
+	unsigned num_started_threads = 0;
+	u32 count = num_chunks - first_chunk;
+	u32 num_done = 0;
+	bool serial = true;
+	int ret = 0;
+
+	num_threads = min(get_available_cpus(), (unsigned)INTEGRITY_MAX_THREADS);
+	h.num_bufs = min(num_threads + 1,
+			 INTEGRITY_MAX_BUFFERED_BYTES / ctx->chunk_size);
+	h.num_bufs = min(h.num_bufs, count);
+	if (h.num_bufs < 2)
+		return checksum_chunks_serial(ctx, first_chunk, num_chunks);
+	num_threads = min(num_threads, h.num_bufs);
+
+	if (!mutex_init(&h.lock))
+		goto out_serial;
+	if (!condvar_init(&h.chunk_read_cond))
+		goto out_destroy_lock;
+	if (!condvar_init(&h.chunk_hashed_cond))
+		goto out_destroy_chunk_read_cond;
+	h.bufs = CALLOC(h.num_bufs, sizeof(h.bufs[0]));
+	if (!h.bufs)
+		goto out_destroy_chunk_hashed_cond;
+	for (unsigned i = 0; i < h.num_bufs; i++) {
+		h.bufs[i].data = MALLOC(ctx->chunk_size);
+		if (!h.bufs[i].data)
+			goto out_free_bufs;
+	}
+	while (num_started_threads < num_threads &&
+	       thread_create(&threads[num_started_threads],
+			     integrity_thread_proc, &h))
+		num_started_threads++;
+	if (num_started_threads == 0)
+		goto out_free_bufs;
+	serial = false;
+
+	for (u32 n = 0; n < count; n++) {
+		struct integrity_buffer *buf = &h.bufs[n % h.num_bufs];
+		u32 i = first_chunk + n;
+
+		/* Wait for the chunk that last used this buffer.  */
+		while (n - num_done >= h.num_bufs) {
+			ret = integrity_wait_chunk(ctx, &h, num_done,
+						   first_chunk + num_done);
+			if (ret)
+				goto out_stop_threads;
+			num_done++;
+		}
+
+		buf->size = integrity_chunk_size(ctx, i);
+		ret = full_pread(ctx->in_fd, buf->data, buf->size,
+				 integrity_chunk_offset(ctx, i));
+		if (ret) {
+			ERROR_WITH_ERRNO("Read error while calculating "
+					 "integrity checksums");
+			goto out_stop_threads;
+		}
+
+		mutex_lock(&h.lock);
+		h.num_read++;
+		condvar_signal(&h.chunk_read_cond);
+		mutex_unlock(&h.lock);
+	}
+	while (num_done < count) {
+		ret = integrity_wait_chunk(ctx, &h, num_done,
+					   first_chunk + num_done);
+		if (ret)
+			goto out_stop_threads;
+		num_done++;
+	}
+	ret = 0;
+
+out_stop_threads:
+	mutex_lock(&h.lock);
+	h.done_reading = true;
+	condvar_broadcast(&h.chunk_read_cond);
+	mutex_unlock(&h.lock);
+	while (num_started_threads)
+		thread_join(&threads[--num_started_threads]);
+out_free_bufs:
+	for (unsigned i = 0; i < h.num_bufs; i++)
+		FREE(h.bufs[i].data);
+	FREE(h.bufs);
+out_destroy_chunk_hashed_cond:
+	condvar_destroy(&h.chunk_hashed_cond);
+out_destroy_chunk_read_cond:
+	condvar_destroy(&h.chunk_read_cond);
+out_destroy_lock:
+	mutex_destroy(&h.lock);
+out_serial:
+	if (serial)
+		return checksum_chunks_serial(ctx, first_chunk, num_chunks);
+	return ret;
+}
 
 /*
  * read_integrity_table: -  Reads the integrity table from a WIM file.
@@ -205,7 +452,6 @@ calculate_integrity_table(struct filedes *in_fd,
 	u32 new_num_chunks = DIV_ROUND_UP(new_check_bytes, chunk_size);
 
 	size_t old_last_chunk_size = MODULO_NONZERO(old_check_bytes, chunk_size);
-	size_t new_last_chunk_size = MODULO_NONZERO(new_check_bytes, chunk_size);
 
 	size_t new_table_size = 12 + new_num_chunks * SHA1_HASH_SIZE;
 
@@ -216,50 +462,47 @@ calculate_integrity_table(struct filedes *in_fd,
 	new_table->size = new_table_size;
 	new_table->chunk_size = chunk_size;
 
-	u64 offset = WIM_HEADER_DISK_SIZE;
-	union wimlib_progress_info progress;
-
-	progress.integrity.total_bytes      = new_check_bytes;
-	progress.integrity.total_chunks     = new_num_chunks;
-	progress.integrity.completed_chunks = 0;
-	progress.integrity.completed_bytes  = 0;
-	progress.integrity.chunk_size       = chunk_size;
-	progress.integrity.filename         = NULL;
+	struct integrity_ctx ctx = {
+		.in_fd = in_fd,
+		.check_bytes = new_check_bytes,
+		.chunk_size = chunk_size,
+		.new_table = new_table,
+		.progress_msg = WIMLIB_PROGRESS_MSG_CALC_INTEGRITY,
+		.progfunc = progfunc,
+		.progctx = progctx,
+	};
+	u32 i;
+
+	ctx.progress.integrity.total_bytes      = new_check_bytes;
+	ctx.progress.integrity.total_chunks     = new_num_chunks;
+	ctx.progress.integrity.completed_chunks = 0;
+	ctx.progress.integrity.completed_bytes  = 0;
+	ctx.progress.integrity.chunk_size       = chunk_size;
+	ctx.progress.integrity.filename         = NULL;
 
 	ret = call_progress(progfunc, WIMLIB_PROGRESS_MSG_CALC_INTEGRITY,
-			    &progress, progctx);
+			    &ctx.progress, progctx);
 	if (ret)
 		goto out_free_new_table;
 
-	for (u32 i = 0; i < new_num_chunks; i++) {
-		size_t this_chunk_size;
-		if (i == new_num_chunks - 1)
-			this_chunk_size = new_last_chunk_size;
-		else
-			this_chunk_size = chunk_size;
-		if (old_table &&
-		    ((this_chunk_size == chunk_size && i < old_num_chunks - 1) ||
-		      (i == old_num_chunks - 1 && this_chunk_size == old_last_chunk_size)))
-		{
-			/* Can use SHA1 message digest from old integrity table
-			 * */
-			copy_hash(new_table->sha1sums[i], old_table->sha1sums[i]);
-		} else {
-			/* Calculate the SHA1 message digest of this chunk */
-			ret = calculate_chunk_sha1(in_fd, this_chunk_size,
-						   offset, new_table->sha1sums[i]);
-			if (ret)
-				goto out_free_new_table;
-		}
-		offset += this_chunk_size;
+	/* The SHA1 message digests of a prefix of the chunks may be reused
+	 * from the old integrity table.  */
+	for (i = 0; old_table && i < new_num_chunks; i++) {
+		size_t this_chunk_size = integrity_chunk_size(&ctx, i);
 
-		progress.integrity.completed_chunks++;
-		progress.integrity.completed_bytes += this_chunk_size;
-		ret = call_progress(progfunc, WIMLIB_PROGRESS_MSG_CALC_INTEGRITY,
-				    &progress, progctx);
+		if (!((this_chunk_size == chunk_size && i < old_num_chunks - 1) ||
+		      (i == old_num_chunks - 1 && this_chunk_size == old_last_chunk_size)))
+			break;
+		ret = integrity_chunk_done(&ctx, i, old_table->sha1sums[i]);
 		if (ret)
 			goto out_free_new_table;
 	}
+
+	/* Calculate the SHA1 message digests of the remaining chunks */
+	ret = checksum_chunks(&ctx, i, new_num_chunks);
+	if (ret)
+		goto out_free_new_table;
+
 	*integrity_table_ret = new_table;
 	return 0;
 
@@ -362,46 +605,31 @@ verify_integrity(struct filedes *in_fd, const tchar *filename,
 		 wimlib_progress_func_t progfunc, void *progctx)
 {
 	int ret;
-	u64 offset = WIM_HEADER_DISK_SIZE;
-	u8 sha1_md[SHA1_HASH_SIZE];
-	union wimlib_progress_info progress;
-
-	progress.integrity.total_bytes      = bytes_to_check;
-	progress.integrity.total_chunks     = table->num_entries;
-	progress.integrity.completed_chunks = 0;
-	progress.integrity.completed_bytes  = 0;
-	progress.integrity.chunk_size       = table->chunk_size;
-	progress.integrity.filename         = filename;
+	struct integrity_ctx ctx = {
+		.in_fd = in_fd,
+		.check_bytes = bytes_to_check,
+		.chunk_size = table->chunk_size,
+		.table_to_verify = table,
+		.progress_msg = WIMLIB_PROGRESS_MSG_VERIFY_INTEGRITY,
+		.progfunc = progfunc,
+		.progctx = progctx,
+	};
+
+	ctx.progress.integrity.total_bytes      = bytes_to_check;
+	ctx.progress.integrity.total_chunks     = table->num_entries;
+	ctx.progress.integrity.completed_chunks = 0;
+	ctx.progress.integrity.completed_bytes  = 0;
+	ctx.progress.integrity.chunk_size       = table->chunk_size;
+	ctx.progress.integrity.filename         = filename;
 
 	ret = call_progress(progfunc, WIMLIB_PROGRESS_MSG_VERIFY_INTEGRITY,
-			    &progress, progctx);
+			    &ctx.progress, progctx);
 	if (ret)
 		return ret;
 
-	for (u32 i = 0; i < table->num_entries; i++) {
-		size_t this_chunk_size;
-		if (i == table->num_entries - 1)
-			this_chunk_size = MODULO_NONZERO(bytes_to_check,
-							 table->chunk_size);
-		else
-			this_chunk_size = table->chunk_size;
-
-		ret = calculate_chunk_sha1(in_fd, this_chunk_size, offset, sha1_md);
-		if (ret)
-			return ret;
-
-		if (!hashes_equal(sha1_md, table->sha1sums[i]))
-			return WIM_INTEGRITY_NOT_OK;
-
-		offset += this_chunk_size;
-		progress.integrity.completed_chunks++;
-		progress.integrity.completed_bytes += this_chunk_size;
-
-		ret = call_progress(progfunc, WIMLIB_PROGRESS_MSG_VERIFY_INTEGRITY,
-				    &progress, progctx);
-		if (ret)
-			return ret;
-	}
+	ret = checksum_chunks(&ctx, 0, table->num_entries);
+	if (ret)
+		return ret;
 	return WIM_INTEGRITY_OK;
 }
 
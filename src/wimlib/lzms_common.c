@@ -29,6 +29,8 @@
 
 #ifdef __x86_64__
 #  include <emmintrin.h>
+#elif defined(_MSC_VER) && defined(_M_X64)
+#  include <nmmintrin.h>
 #endif
 
 /* Table: offset slot => offset slot base value  */
@@ -403,6 +405,26 @@ find_next_opcode_sse4_2(u8 *p)
 
 	return p;
 }
+#elif defined(_MSC_VER) && defined(_M_X64)
+/*
+ * MSVC does not support inline assembly on x86_64, so use the intrinsic for
+ * the same PCMPESTRI instruction.  MSVC does not require SSE4.2 code generation
+ * to be enabled for this, and the caller checks for SSE4.2 support at runtime.
+ */
+static forceinline u8 *
+find_next_opcode_sse4_2(u8 *p)
+{
+	const __m128i potential_opcodes = _mm_setr_epi8(0x48, 0x4C, 0xE8, 0xE9,
+		0xF0, 0xFF, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	int i;
+
+	while ((i = _mm_cmpestri(potential_opcodes, 6,
+				 _mm_loadu_si128((const __m128i *)p), 16,
+				 _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY |
+				 _SIDD_LEAST_SIGNIFICANT)) == 16)
+		p += 16;
+	return p + i;
+}
 #endif /* __x86_64__ */
 
 static forceinline u8 *
@@ -613,7 +635,7 @@ lzms_x86_filter(u8* restrict data, s32 size,
 	p = data + 1;
 	tail_ptr = &data[size - 16];
 
-#ifdef __x86_64__
+#if defined(__x86_64__) || (defined(_MSC_VER) && defined(_M_X64))
 	if (cpu_features & X86_CPU_FEATURE_SSE4_2) {
 		u8 saved_byte = *tail_ptr;
 		*tail_ptr = 0xE8;
@@ -829,7 +829,8 @@ begin_read(WIMStruct *wim, const void *wim_filename_or_fd, int open_flags)
 		}
 	}
 
-	if (wim->hdr.image_count != 0 && wim->hdr.part_number == 1) {
+	if (wim->hdr.image_count != 0 && wim->hdr.part_number == 1 &&
+	    !(open_flags & WIMLIB_OPEN_FLAG_XML_ONLY)) {
 		wim->image_metadata = CALLOC(wim->hdr.image_count,
 					     sizeof(wim->image_metadata[0]));
 		if (!wim->image_metadata)
@@ -856,6 +857,13 @@ begin_read(WIMStruct *wim, const void *wim_filename_or_fd, int open_flags)
 			return WIMLIB_ERR_IMAGE_COUNT;
 		}
 
+		/* Leave the blob table empty, as with a pipe that hasn't been
+		 * read yet, so that wim_has_metadata() returns false.  */
+		if (open_flags & WIMLIB_OPEN_FLAG_XML_ONLY) {
+			wim->blob_table = new_blob_table(64);
+			return wim->blob_table ? 0 : WIMLIB_ERR_NOMEM;
+		}
+
 		ret = read_blob_table(wim);
 		if (ret)
 			return ret;
@@ -900,7 +908,12 @@ wimlib_open_wim_with_progress(const tchar *wimfile, int open_flags,
 {
 	if (open_flags & ~(WIMLIB_OPEN_FLAG_CHECK_INTEGRITY |
 			   WIMLIB_OPEN_FLAG_ERROR_IF_SPLIT |
-			   WIMLIB_OPEN_FLAG_WRITE_ACCESS))
+			   WIMLIB_OPEN_FLAG_WRITE_ACCESS |
+			   WIMLIB_OPEN_FLAG_XML_ONLY))
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	if ((open_flags & WIMLIB_OPEN_FLAG_XML_ONLY) &&
+	    (open_flags & WIMLIB_OPEN_FLAG_WRITE_ACCESS))
 		return WIMLIB_ERR_INVALID_PARAM;
 
 	if (!wimfile || !*wimfile || !wim_ret)
@@ -987,9 +1000,11 @@ wim_decrement_refcnt(WIMStruct *wim)
 	if (wim->in_fd.is_udf) {
 		udf_dirent_free(wim->in_fd.p_udf_file);
 		udf_close(wim->in_fd.p_udf);
+		FREE(wim->in_fd.cache);
 	} else if (wim->in_fd.is_iso) {
 		iso9660_stat_free(wim->in_fd.p_iso_file);
 		iso9660_close(wim->in_fd.p_iso);
+		FREE(wim->in_fd.cache);
 	} else {
 #endif
 		if (filedes_valid(&wim->in_fd))
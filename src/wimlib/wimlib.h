@@ -2157,6 +2157,14 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  * called.  */
 #define WIMLIB_OPEN_FLAG_WRITE_ACCESS			0x00000004
 
+/** Only read the header and the XML data of the WIM, and skip the blob table.
+ * This makes opening a large WIM or ESD much faster, especially when it resides
+ * inside an ISO image, but the resulting ::WIMStruct can only be used to query
+ * the XML data and the WIM information.  Any operation that requires the image
+ * metadata fails with ::WIMLIB_ERR_METADATA_NOT_FOUND.  This flag cannot be
+ * combined with ::WIMLIB_OPEN_FLAG_WRITE_ACCESS.  */
+#define WIMLIB_OPEN_FLAG_XML_ONLY			0x00000008
+
 /** @} */
 /** @addtogroup G_mounting_wim_images
  * @{ */
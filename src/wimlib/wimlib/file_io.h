@@ -6,6 +6,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "wimlib/types.h"
+
 #ifdef WITH_LIBCDIO
 #  define DO_NOT_WANT_COMPATIBILITY
 #  undef PRAGMA_BEGIN_PACKED
@@ -34,6 +36,12 @@ struct filedes {
 		udf_dirent_t* p_udf_file;
 		iso9660_stat_t* p_iso_file;
 	};
+	/* Read-ahead cache, for WIMs that reside in an ISO image */
+	u8* cache;
+	u64 cache_start;
+	size_t cache_size;
+	size_t read_ahead;
+	u64 read_ahead_next;
 #endif
 	off_t offset;
 };
@@ -71,7 +71,7 @@ char* GetUILanguage(void)
 	static_strcpy(wim_path, image_path);
 	static_strcat(wim_path, "|sources/boot.wim");
 
-	r = wimlib_open_wimU(wim_path, 0, &wim);
+	r = wimlib_open_wimU(wim_path, WIMLIB_OPEN_FLAG_XML_ONLY, &wim);
 	if (r != 0) {
 		uprintf("Could not open WIM: Error %d", r);
 		goto out;
@@ -733,7 +733,7 @@ BOOL PopulateWindowsVersion(void)
 		static_strcat(wim_path, &img_report.wininst_path[0][3]);
 	}
 
-	r = wimlib_open_wimU(wim_path, 0, &wim);
+	r = wimlib_open_wimU(wim_path, WIMLIB_OPEN_FLAG_XML_ONLY, &wim);
 	if (r != 0) {
 		uprintf("Could not open WIM: Error %d", r);
 		goto out;
@@ -788,7 +788,7 @@ int GetEditions(StrArray* version_name, StrArray* version_index)
 			&wim_path[wcslen(wim_path)], (int)ARRAYSIZE(wim_path) - wcslen(wim_path));
 	}
 
-	r = wimlib_open_wim(wim_path, 0, &wim);
+	r = wimlib_open_wim(wim_path, WIMLIB_OPEN_FLAG_XML_ONLY, &wim);
 	if (r != 0) {
 		uprintf("Could not open WIM: %d", r);
 		goto out;
@@ -884,7 +884,7 @@ int SetWinToGoIndex(void)
 			&wim_path[wcslen(wim_path)], (int)ARRAYSIZE(wim_path) - wcslen(wim_path));
 	}
 
-	r = wimlib_open_wim(wim_path, 0, &wim);
+	r = wimlib_open_wim(wim_path, WIMLIB_OPEN_FLAG_XML_ONLY, &wim);
 	if (r != 0) {
 		uprintf("Could not open WIM: %d", r);
 		goto out;
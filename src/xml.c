@@ -45,11 +45,18 @@
 #define EZXML_WS     "\t\r\n "  // whitespace
 #define EZXML_ERRL   256        // maximum error string length
 #define EZXML_MAXEXP (8 * MB)   // max entity expansion (to prevent "billion laughs" blowup)
+#define EZXML_POOLSZ 256        // number of tags per pool block
 
 #ifdef _MSC_VER
 #pragma warning(disable:6011)
 #pragma warning(disable:4267)
 #endif
+typedef struct ezxml_pool *ezxml_pool_t;
+struct ezxml_pool {       // block of tags allocated by the parser
+    ezxml_pool_t next;    // previously allocated block
+    struct ezxml tag[EZXML_POOLSZ];
+};
+
 typedef struct ezxml_root *ezxml_root_t;
 struct ezxml_root {       // additional data for the root tag
     struct ezxml xml;     // is a super-struct built on top of ezxml struct
@@ -62,12 +69,16 @@ struct ezxml_root {       // additional data for the root tag
     char **ent;           // general entities (ampersand sequences)
     char ***attr;         // default attributes
     char ***pi;           // processing instructions
+    ezxml_pool_t pool;    // blocks of tags allocated by the parser
+    int pool_used;        // number of tags used in the current pool block
     short standalone;     // non-zero if <?xml standalone="yes"?>
     char err[EZXML_ERRL]; // error string
 };
 
 char *EZXML_NIL[] = { NULL }; // empty, null terminated array of strings
 
+void ezxml_free_attr(char **attr);
+
 // what realloc should be doing all along
 static inline void* _realloc(void* ptr, size_t size) {
     void* old_ptr = ptr;
@@ -121,14 +132,17 @@ const char *ezxml_attr(ezxml_t xml, const char *attr)
 // same as ezxml_get but takes an already initialized va_list
 ezxml_t ezxml_vget(ezxml_t xml, va_list ap)
 {
-    char *name = va_arg(ap, char *);
-    int idx = -1;
-
-    if (name && *name) {
-        idx = va_arg(ap, int);    
-        xml = ezxml_child(xml, name);
+    char *name;
+    int idx;
+
+    while (xml && (name = va_arg(ap, char *)) && *name) {
+        idx = va_arg(ap, int);
+        for (xml = xml->child; xml && strcmp(name, xml->name);
+             xml = xml->sibling); // find the first tag with this name
+        if (idx < 0) break;
+        for (; xml && idx; idx--) xml = xml->next;
     }
-    return (idx < 0) ? xml : ezxml_vget(ezxml_idx(xml, idx), ap);
+    return xml;
 }
 
 // Traverses the xml tree to retrieve a specific subtag. Takes a variable
@@ -268,12 +282,37 @@ char *ezxml_decode(char *s, char **ent, char t)
     return r;
 }
 
+// returns a zeroed tag from the root tag pool, allocating a new block if needed
+static ezxml_t ezxml_pool_tag(ezxml_root_t root)
+{
+    ezxml_pool_t pool;
+    ezxml_t xml;
+
+    if (! root->pool || root->pool_used == EZXML_POOLSZ) {
+        if (! (pool = malloc(sizeof(struct ezxml_pool)))) return NULL;
+        pool->next = root->pool;
+        root->pool = pool;
+        root->pool_used = 0;
+    }
+    xml = memset(&root->pool->tag[root->pool_used++], '\0', sizeof(struct ezxml));
+    xml->flags = EZXML_POOL;
+    return xml;
+}
+
 // called when parser finds start of new tag
 void ezxml_open_tag(ezxml_root_t root, char *name, char **attr)
 {
-    ezxml_t xml = root->cur;
+    ezxml_t xml = root->cur, child;
     
-    if (xml->name) xml = ezxml_add_child(xml, name, strlen(xml->txt));
+    if (xml->name) { // add a child tag from the pool
+        if (! (child = ezxml_pool_tag(root))) {
+            ezxml_free_attr(attr);
+            return;
+        }
+        child->name = name;
+        child->txt = "";
+        xml = ezxml_insert(child, xml, strlen(xml->txt));
+    }
     else xml->name = name; // first open tag
 
     xml->attr = attr;
@@ -488,31 +527,32 @@ short ezxml_internal_dtd(ezxml_root_t root, char *s, size_t len)
 // or NULL if no conversion was needed.
 char *ezxml_str2utf8(char **s, size_t *len)
 {
+    uint8_t *p = (uint8_t *)*s;
     char *u;
-    size_t l = 0, sl, max = *len;
+    size_t l = 0, sl, n = *len - 1;
     long c, d;
     int b, be = (**s == '\xFE') ? 1 : (**s == '\xFF') ? 0 : -1;
 
     if (be == -1) return NULL; // not UTF-16
 
-    u = malloc(max);
-    for (sl = 2; sl < *len - 1; sl += 2) {
-        c = (be) ? (((*s)[sl] & 0xFF) << 8) | ((*s)[sl + 1] & 0xFF)  //UTF-16BE
-                 : (((*s)[sl + 1] & 0xFF) << 8) | ((*s)[sl] & 0xFF); //UTF-16LE
-        if (c >= 0xD800 && c <= 0xDFFF && (sl += 2) < *len - 1) { // high-half
-            d = (be) ? (((*s)[sl] & 0xFF) << 8) | ((*s)[sl + 1] & 0xFF)
-                     : (((*s)[sl + 1] & 0xFF) << 8) | ((*s)[sl] & 0xFF);
-            c = (((c & 0x3FF) << 10) | (d & 0x3FF)) + 0x10000;
+    // a UTF-16 code unit never expands to more than 3 UTF-8 bytes, and a
+    // surrogate pair to no more than 4, so this is large enough for it all
+    if (! (u = malloc((*len / 2) * 3 + 1))) return NULL;
+    for (sl = 2; sl < n; sl += 2) {
+        c = (be) ? (p[sl] << 8) | p[sl + 1] : (p[sl + 1] << 8) | p[sl];
+        if (c < 0x80) { // US-ASCII subset
+            u[l++] = (char)c;
+            continue;
         }
-
-        while (l + 6 > max) u = _realloc(u, max += EZXML_BUFSIZE);
-        if (c < 0x80) u[l++] = (char)c; // US-ASCII subset
-        else { // multi-byte UTF-8 sequence
-            for (b = 0, d = c; d; d /= 2) b++; // bits in c
-            b = (b - 2) / 5; // bytes in payload
-            u[l++] = (char)(0xFF << (7 - b)) | (char)(c >> (6 * b)); // head
-            while (b) u[l++] = 0x80 | ((c >> (6 * --b)) & 0x3F); // payload
+        if (c >= 0xD800 && c <= 0xDFFF && (sl += 2) < n) { // high-half
+            d = (be) ? (p[sl] << 8) | p[sl + 1] : (p[sl + 1] << 8) | p[sl];
+            c = (((c & 0x3FF) << 10) | (d & 0x3FF)) + 0x10000;
         }
+        // multi-byte UTF-8 sequence
+        for (b = 0, d = c; d; d /= 2) b++; // bits in c
+        b = (b - 2) / 5; // bytes in payload
+        u[l++] = (char)(0xFF << (7 - b)) | (char)(c >> (6 * b)); // head
+        while (b) u[l++] = 0x80 | ((c >> (6 * --b)) & 0x3F); // payload
     }
     return *s = _realloc(u, *len = l);
 }
@@ -856,6 +896,7 @@ char *ezxml_toxml(ezxml_t xml)
 void ezxml_free(ezxml_t xml)
 {
     ezxml_root_t root = (ezxml_root_t)xml;
+    ezxml_pool_t p;
     int i, j;
     char **a, *s;
 
@@ -887,12 +928,17 @@ void ezxml_free(ezxml_t xml)
         else if (root->len) munmap(root->m, root->len); // mem mapped xml data
 #endif // EZXML_NOMMAP
         if (root->u) free(root->u); // utf8 conversion
+
+        while ((p = root->pool)) { // tags allocated by the parser
+            root->pool = p->next;
+            free(p);
+        }
     }
 
     ezxml_free_attr(xml->attr); // tag attributes
     if ((xml->flags & EZXML_TXTM)) free(xml->txt); // character content
     if ((xml->flags & EZXML_NAMEM)) free(xml->name); // tag name
-    free(xml);
+    if (! (xml->flags & EZXML_POOL)) free(xml); // released with the pool
 }
 
 // return parser error message or empty string if none
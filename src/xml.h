@@ -38,6 +38,7 @@ extern "C" {
 #define EZXML_NAMEM   0x80 // name is malloced
 #define EZXML_TXTM    0x40 // txt is malloced
 #define EZXML_DUP     0x20 // attribute name and value are strduped
+#define EZXML_POOL    0x10 // tag was allocated from the root tag pool
 
 typedef struct ezxml *ezxml_t;
 struct ezxml {
@@ -56,7 +57,9 @@ struct ezxml {
 // Given a string of xml data and its length, parses it and creates an ezxml
 // structure. For efficiency, modifies the data by adding null terminators
 // and decoding ampersand sequences. If you don't want this, copy the data and
-// pass in the copy. Returns NULL on failure.
+// pass in the copy. Tags are allocated in blocks that are owned by the root
+// tag, so a tag that is cut from a parsed structure remains valid only until
+// the root tag is freed. Returns NULL on failure.
 ezxml_t ezxml_parse_str(char *s, size_t len);
 
 // A wrapper for ezxml_parse_str() that accepts a file descriptor. First